@@ -0,0 +1,92 @@
+#include <string.h>
+#include <time.h>
+
+#include "hdr.h"
+
+#define HDR_SUB (1u << HDR_SUB_BITS)
+
+static unsigned int hdr_index(uint64_t value)
+{
+    if (value < HDR_SUB)
+        return value;
+
+    unsigned int mag = 63 - __builtin_clzll(value) - HDR_SUB_BITS + 1;
+    return (mag << HDR_SUB_BITS) + (value >> (mag - 1)) - HDR_SUB;
+}
+
+static uint64_t hdr_upper(unsigned int idx)
+{
+    unsigned int mag = idx >> HDR_SUB_BITS;
+    uint64_t     sub = idx & (HDR_SUB - 1);
+
+    if (mag == 0)
+        return sub;
+    return ((sub + HDR_SUB + 1) << (mag - 1)) - 1;
+}
+
+void hdr_reset(hdr_t* hdr)
+{
+    memset(hdr, 0, sizeof(*hdr));
+}
+
+void hdr_record(hdr_t* hdr, uint64_t value)
+{
+    hdr->counts[hdr_index(value)]++;
+    hdr->count++;
+    hdr->sum += value;
+    if (value > hdr->max)
+        hdr->max = value;
+}
+
+void hdr_merge(hdr_t* dst, const hdr_t* src)
+{
+    for (unsigned int i = 0; i < HDR_BUCKETS; ++i)
+        dst->counts[i] += src->counts[i];
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hdr_quantile(const hdr_t* hdr, double q)
+{
+    uint64_t rank = (uint64_t)(q * hdr->count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (unsigned int i = 0; i < HDR_BUCKETS; ++i)
+    {
+        seen += hdr->counts[i];
+        if (seen >= rank)
+            return (hdr_upper(i) < hdr->max) ? hdr_upper(i) : hdr->max;
+    }
+    return hdr->max;
+}
+
+void hdr_json(const hdr_t* hdr, FILE* out)
+{
+    fprintf(out, "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,"
+            "\"max_us\":%.3f,\"mean_us\":%.3f,\"hist\":[",
+            hdr_quantile(hdr, 0.50) / 1e3, hdr_quantile(hdr, 0.99) / 1e3,
+            hdr_quantile(hdr, 0.999) / 1e3, hdr->max / 1e3,
+            hdr->count ? (double)hdr->sum / hdr->count / 1e3 : 0.0);
+
+    const char* sep = "";
+    for (unsigned int i = 0; i < HDR_BUCKETS; ++i)
+        if (hdr->counts[i])
+        {
+            fprintf(out, "%s[%llu,%llu]", sep,
+                    (unsigned long long)hdr_upper(i),
+                    (unsigned long long)hdr->counts[i]);
+            sep = ",";
+        }
+    fprintf(out, "]");
+}
+
+uint64_t hdr_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,44 @@
+#ifndef HDR_H
+#define HDR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HDR_SUB_BITS (7)
+#define HDR_BUCKETS  ((64 - HDR_SUB_BITS + 1) << HDR_SUB_BITS)
+
+/*
+ * Log-linear latency histogram in the HdrHistogram layout: every power
+ * of two is split into 2^HDR_SUB_BITS linear sub-buckets, so recorded
+ * values keep about 1% precision from nanoseconds to hours. One per
+ * thread, merged once the run is over.
+ */
+typedef struct hdr_t
+{
+  uint64_t count;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t counts[HDR_BUCKETS];
+} hdr_t;
+
+void hdr_reset(hdr_t* hdr);
+
+/* Records one value, in whatever unit the caller uses (ns here) */
+void hdr_record(hdr_t* hdr, uint64_t value);
+
+void hdr_merge(hdr_t* dst, const hdr_t* src);
+
+/* Value at quantile q in [0, 1], the upper edge of its sub-bucket */
+uint64_t hdr_quantile(const hdr_t* hdr, double q);
+
+/*
+ * Prints "p50_us":..,"p99_us":..,"p999_us":..,"max_us":..,"mean_us":..
+ * and "hist":[[upper_ns,count],..] for the non-empty buckets, as JSON
+ * members without the surrounding braces.
+ */
+void hdr_json(const hdr_t* hdr, FILE* out);
+
+/* Monotonic clock in ns */
+uint64_t hdr_now();
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * ipcbench - cost of the IPC primitives below handle_with_cache, each
+ * measured across a fork so both ends run in separate processes:
+ *
+ *   futex_handoff     shm_post/shm_wait ping-pong on a cache_t pair
+ *   sem_handoff       the same ping-pong on process shared sem_t, the
+ *                     primitive the futex words replaced
+ *   submit_roundtrip  req_send -> get_requests -> shm_post back
+ *   submit_burst      back to back req_send, drained in batches
+ *
+ * Each result is one JSON object per line, latencies as in hdr.h.
+ *
+ *   gcc -O2 -pthread -I. -o bench/ipcbench bench/ipcbench.c bench/hdr.c \
+ *       shm_channel.c -lrt
+ *   bench/ipcbench [iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "shm_channel.h"
+#include "hdr.h"
+
+#define ARENA_SIZE (4 * 1024 * 1024)
+#define SEG_SIZE   (4096)
+#define BATCH      (16)
+
+typedef struct sem_pair_t
+{
+  sem_t ping;
+  sem_t pong;
+} sem_pair_t;
+
+void report(const char* name, long iters, uint64_t elapsed, hdr_t* hdr);
+void bench_futex(shm_t* shm, long iters);
+void bench_sem(shm_t* shm, long iters);
+void bench_submit(cmd_chl_t* cmd_chl, shm_t* shm, long iters);
+void receiver(long iters);
+void bench_burst(cmd_chl_t* cmd_chl, shm_t* shm, long iters);
+
+int main(int argc, char **argv)
+{
+    long iters = (argc > 1) ? atol(argv[1]) : 100000;
+    if (iters < 1)
+    {
+        fprintf(stderr, "usage: ipcbench [iterations]\n");
+        exit(1);
+    }
+
+    cleanup_msg(0);
+    shm_unlink(SHM_ARENA);
+    if (arena_create(ARENA_SIZE))
+    {
+        perror("arena_create");
+        exit(1);
+    }
+
+    shm_t* shm = shm_alloc(SEG_SIZE);
+    cmd_chl_t* cmd_chl = cmd_snd_ini(0, 1);
+    if (!shm || !cmd_chl)
+    {
+        fprintf(stderr, "channel setup failed\n");
+        goto done;
+    }
+
+    bench_futex(shm, iters);
+    bench_sem(shm, iters);
+
+    pid_t pid = fork();
+    if (pid == 0)
+        receiver(iters);
+    bench_submit(cmd_chl, shm, iters);
+    bench_burst(cmd_chl, shm, iters);
+    waitpid(pid, NULL, 0);
+
+  done:
+    cleanup_msg(0);
+    shm_unlink(SHM_ARENA);
+    return 0;
+}
+
+void report(const char* name, long iters, uint64_t elapsed, hdr_t* hdr)
+{
+    printf("{\"bench\":\"%s\",\"iters\":%ld,\"ops_per_s\":%.1f", name, iters,
+           iters / (elapsed / 1e9));
+    if (hdr)
+    {
+        printf(",");
+        hdr_json(hdr, stdout);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/* the child inherits the arena mapping, no attach needed */
+void bench_futex(shm_t* shm, long iters)
+{
+    cache_t* cache = cache_init(shm);
+    hdr_t*   hdr   = calloc(1, sizeof(hdr_t));
+
+    cache_sync_init(shm);
+    shm_wait(&cache->writer, SHM_FOREVER);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        for (long i = 0; i < iters; ++i)
+        {
+            shm_wait(&cache->reader, SHM_FOREVER);
+            shm_post(&cache->writer);
+        }
+        _exit(0);
+    }
+
+    uint64_t start = hdr_now();
+    for (long i = 0; i < iters; ++i)
+    {
+        uint64_t t = hdr_now();
+        shm_post(&cache->reader);
+        shm_wait(&cache->writer, SHM_FOREVER);
+        hdr_record(hdr, hdr_now() - t);
+    }
+    report("futex_handoff", iters, hdr_now() - start, hdr);
+
+    waitpid(pid, NULL, 0);
+    free(hdr);
+}
+
+void bench_sem(shm_t* shm, long iters)
+{
+    sem_pair_t* sem = shm_getdata(shm);
+    hdr_t*      hdr = calloc(1, sizeof(hdr_t));
+
+    sem_init(&sem->ping, 1, 0);
+    sem_init(&sem->pong, 1, 0);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        for (long i = 0; i < iters; ++i)
+        {
+            sem_wait(&sem->ping);
+            sem_post(&sem->pong);
+        }
+        _exit(0);
+    }
+
+    uint64_t start = hdr_now();
+    for (long i = 0; i < iters; ++i)
+    {
+        uint64_t t = hdr_now();
+        sem_post(&sem->ping);
+        sem_wait(&sem->pong);
+        hdr_record(hdr, hdr_now() - t);
+    }
+    report("sem_handoff", iters, hdr_now() - start, hdr);
+
+    waitpid(pid, NULL, 0);
+    sem_destroy(&sem->ping);
+    sem_destroy(&sem->pong);
+    free(hdr);
+}
+
+static void post_reader(req_t* req)
+{
+    shm_t* shm = shmseg_lookup(req->shm_off, req->shm_size);
+    shm_post(&((cache_t*)shm_getdata(shm))->reader);
+}
+
+/* 
+ * The daemon side of both submit benches, attached through cmd_rcv_ini
+ * like simplecached: answers every request of the round trip phase,
+ * then only the last one of the burst.
+ */
+void receiver(long iters)
+{
+    req_t  reqs[BATCH];
+    req_t* batch[BATCH];
+    for (int i = 0; i < BATCH; ++i)
+        batch[i] = &reqs[i];
+
+    arena_detach();
+    cmd_chl_t* cmd_chl = cmd_rcv_ini(0);
+    if (!cmd_chl)
+        _exit(1);
+
+    for (long got = 0; got < iters; )
+    {
+        int n = get_requests(cmd_chl->sq[0], batch, BATCH);
+        for (int i = 0; i < n; ++i)
+            post_reader(&reqs[i]);
+        got += n;
+    }
+    for (long got = 0; got < iters; )
+    {
+        int n = get_requests(cmd_chl->sq[0], batch, BATCH);
+        got += n;
+        if (got >= iters)
+            post_reader(&reqs[n - 1]);
+    }
+    _exit(0);
+}
+
+void bench_submit(cmd_chl_t* cmd_chl, shm_t* shm, long iters)
+{
+    cache_t* cache = cache_init(shm);
+    hdr_t*   hdr   = calloc(1, sizeof(hdr_t));
+    uint64_t hash  = path_hash("/bench", 6);
+
+    cache_sync_init(shm);
+    uint64_t start = hdr_now();
+    for (long i = 0; i < iters; ++i)
+    {
+        uint64_t t = hdr_now();
+        req_send(cmd_chl, "/bench", 6, hash, shm->seg_off, shm->seg_size, 
+                 XFER_CHUNK, SHM_FOREVER);
+        shm_wait(&cache->reader, SHM_FOREVER);
+        hdr_record(hdr, hdr_now() - t);
+    }
+    report("submit_roundtrip", iters, hdr_now() - start, hdr);
+    free(hdr);
+}
+
+void bench_burst(cmd_chl_t* cmd_chl, shm_t* shm, long iters)
+{
+    cache_t* cache = shm_getdata(shm);
+    uint64_t hash  = path_hash("/bench", 6);
+
+    uint64_t start = hdr_now();
+    for (long i = 0; i < iters; ++i)
+        req_send(cmd_chl, "/bench", 6, hash, shm->seg_off, shm->seg_size, 
+                 XFER_CHUNK, SHM_FOREVER);
+    shm_wait(&cache->reader, SHM_FOREVER);
+    report("submit_burst", iters, hdr_now() - start, NULL);
+}
@@ -0,0 +1,397 @@
+/*
+ * loadgen - drives handle_with_cache against a real simplecached.
+ *
+ * Builds a corpus of files for every size under test, then for every
+ * segment spec x segment count x daemon thread count starts a fresh
+ * simplecached on it and, for every proxy thread count x file size,
+ * times requests from the proxy threads. Every run is printed as one
+ * JSON object per line: throughput plus a latency histogram (hdr.h).
+ *
+ * Build from the repository root, next to gfserver.h (only the type
+ * declarations are used, gfs_* are stubbed below) and the curl headers:
+ *
+ *   gcc -O2 -pthread -I. -o bench/loadgen bench/loadgen.c bench/hdr.c \
+ *       handle_with_cache.c shm_channel.c mpmcq.c hotcache.c pathidx.c \
+ *       chash.c stats.c -lrt
+ *
+ * Example, 4 KiB to 1 MiB files over two pool layouts:
+ *
+ *   bench/loadgen -d ./simplecached -f 4096,65536,1048576 \
+ *       -z 65536/4096:32,65536:8 -n 8 -t 1,8,32 -T 4,16 -r 20000
+ *
+ * List options take comma separated values, except -z whose entries are
+ * shm_init_classes specs and are therefore separated by '/'.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "gfserver.h"
+#include "shm_channel.h"
+#include "proxy-student.h"
+#include "hdr.h"
+
+#define MAX_LIST       (16)
+#define DAEMON_WAIT_MS (10000)
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  loadgen -d simplecached [options]\n"                                       \
+"options:\n"                                                                  \
+"  -d [daemon]         Path to the simplecached binary (required)\n"          \
+"  -c [corpus_dir]     Where test files are written (Default: /tmp/loadgen)\n"\
+"  -f [file_sizes]     File sizes in bytes (Default: 4096)\n"                 \
+"  -F [file_count]     Distinct files per size (Default: 64)\n"               \
+"  -z [segment_specs]  Pool specs, '/' separated (Default: 4096)\n"           \
+"  -n [segment_counts] Segments per class (Default: 8)\n"                     \
+"  -t [proxy_threads]  Proxy worker threads (Default: 4)\n"                   \
+"  -T [daemon_threads] simplecached worker threads (Default: 4)\n"            \
+"  -D [daemons]        simplecached instances, paths sharded (Default: 1)\n" \
+"  -q [queues]         Submission rings (Default: 4)\n"                       \
+"  -M [mem_budget]     simplecached object cache in MiB (Default: 0)\n"       \
+"  -r [requests]       Timed requests per run (Default: 10000)\n"             \
+"  -w [warmup]         Untimed requests per run (Default: 1000)\n"            \
+"  -h                  Show this help message\n"
+
+extern ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg);
+
+/* gfserver stand-ins, a response only counts its bytes */
+struct gfcontext_t
+{
+    int    status;
+    size_t bytes;
+};
+
+ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len)
+{
+    ctx->status = status;
+    return 0;
+}
+
+ssize_t gfs_send(gfcontext_t *ctx, const void *data, size_t len)
+{
+    ctx->bytes += len;
+    return len;
+}
+
+void gfs_abort(gfcontext_t *ctx)
+{
+}
+
+typedef struct run_t
+{
+    cache_worker_t    worker;     /* no fallback, a timeout is an error */
+    size_t            file_size;
+    int               nfiles;
+    long              requests;
+    long              warmup;
+    int               nthreads;
+    int               ncaches;
+    volatile long     errors;     /* timed requests only */
+    pthread_barrier_t warm;       /* the clock starts once all warmed up */
+} run_t;
+
+typedef struct worker_t
+{
+    pthread_t thread_id;
+    run_t*    run;
+    int       idx;
+    hdr_t     hdr;
+} worker_t;
+
+static const char* corpus = "/tmp/loadgen";
+static char        locals[256];
+
+int  parse_list(char* arg, long* out, const char* sep);
+void make_corpus(long* sizes, int nsizes, int nfiles);
+void file_key(char* key, size_t len, size_t file_size, int idx);
+pid_t daemon_start(const char* daemon, int instance, cmd_chl_t* chl, 
+                   long nthreads, long mem);
+void daemon_stop(pid_t pid);
+void* workercb(void* args);
+void run_one(run_t* run, FILE* out, const char* spec, long nseg, 
+             long dthreads);
+
+int main(int argc, char **argv)
+{
+    const char* daemon = NULL;
+    char*       specs[MAX_LIST] = { "4096" };
+    long        sizes[MAX_LIST] = { 4096 };
+    long        nsegs[MAX_LIST] = { 8 };
+    long        pthr[MAX_LIST]  = { 4 };
+    long        dthr[MAX_LIST]  = { 4 };
+    int         nspecs = 1, nsizes = 1, nnsegs = 1, npthr = 1, ndthr = 1;
+    long        nfiles = 64, requests = 10000, warmup = 1000;
+    long        nchl = CMD_NCHL, mem = 0, ncaches = 1;
+    int         option_char;
+
+    while ((option_char = getopt(argc, argv, "d:c:f:F:z:n:t:T:D:q:M:r:w:h")) 
+           != -1) 
+    {
+        switch (option_char) 
+        {
+            default:
+                fprintf(stderr, "%s", USAGE);
+                exit(1);
+            case 'h':
+                fprintf(stdout, "%s", USAGE);
+                exit(0);
+            case 'd': daemon   = optarg;                           break;
+            case 'c': corpus   = optarg;                           break;
+            case 'f': nsizes   = parse_list(optarg, sizes, ",");   break;
+            case 'F': nfiles   = atol(optarg);                     break;
+            case 'n': nnsegs   = parse_list(optarg, nsegs, ",");   break;
+            case 't': npthr    = parse_list(optarg, pthr, ",");    break;
+            case 'T': ndthr    = parse_list(optarg, dthr, ",");    break;
+            case 'D': ncaches  = atol(optarg);                     break;
+            case 'q': nchl     = atol(optarg);                     break;
+            case 'M': mem      = atol(optarg);                     break;
+            case 'r': requests = atol(optarg);                     break;
+            case 'w': warmup   = atol(optarg);                     break;
+            case 'z':
+                nspecs = 0;
+                for (char* tok = strtok(optarg, "/"); tok && nspecs < MAX_LIST;
+                     tok = strtok(NULL, "/"))
+                    specs[nspecs++] = tok;
+                break;
+        }
+    }
+
+    if (!daemon || nsizes < 1 || nnsegs < 1 || npthr < 1 || ndthr < 1 ||
+        nspecs < 1 || nfiles < 1 || requests < 1 || ncaches < 1 || 
+        ncaches > MAX_LIST) 
+    {
+        fprintf(stderr, "%s", USAGE);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    make_corpus(sizes, nsizes, nfiles);
+
+    for (int s = 0; s < nspecs; ++s)
+        for (int n = 0; n < nnsegs; ++n)
+            for (int d = 0; d < ndthr; ++d)
+            {
+                run_t      run;
+                cmd_chl_t* chls[MAX_LIST];
+                pid_t      pids[MAX_LIST];
+                memset(&run, 0, sizeof(run));
+
+                if (shm_init_classes(specs[s], nsegs[n]) || 
+                    cache_shards(ncaches))
+                {
+                    fprintf(stderr, "bad segment spec %s\n", specs[s]);
+                    cleanup();
+                    exit(1);
+                }
+                for (int c = 0; c < ncaches; ++c)
+                {
+                    if (NULL == (chls[c] = cmd_snd_ini(c, nchl)))
+                    {
+                        fprintf(stderr, "no room for %ld queues\n", nchl);
+                        cleanup();
+                        exit(1);
+                    }
+                    if (0 > (pids[c] = daemon_start(daemon, c, chls[c], 
+                                                    dthr[d], mem)))
+                    {
+                        fprintf(stderr, "%s did not attach\n", daemon);
+                        cleanup();
+                        exit(1);
+                    }
+                }
+
+                run.worker.chl = chls;
+                run.ncaches    = ncaches;
+                run.nfiles     = nfiles;
+                run.requests   = requests;
+                run.warmup     = warmup;
+                for (int p = 0; p < npthr; ++p)
+                    for (int f = 0; f < nsizes; ++f)
+                    {
+                        run.nthreads  = pthr[p];
+                        run.file_size = sizes[f];
+                        run_one(&run, stdout, specs[s], nsegs[n], dthr[d]);
+                    }
+
+                for (int c = 0; c < ncaches; ++c)
+                {
+                    daemon_stop(pids[c]);
+                    free(chls[c]);
+                }
+                cleanup();
+            }
+    return 0;
+}
+
+int parse_list(char* arg, long* out, const char* sep)
+{
+    int n = 0;
+    for (char* tok = strtok(arg, sep); tok && n < MAX_LIST; 
+         tok = strtok(NULL, sep))
+        out[n++] = atol(tok);
+    return n;
+}
+
+void file_key(char* key, size_t len, size_t file_size, int idx)
+{
+    snprintf(key, len, "/f_%zu_%d", file_size, idx);
+}
+
+/* files are reused between runs, locals.txt maps keys to them */
+void make_corpus(long* sizes, int nsizes, int nfiles)
+{
+    char  key[64], path[512];
+    char* buf = NULL;
+
+    mkdir(corpus, 0755);
+    snprintf(locals, sizeof(locals), "%s/locals.txt", corpus);
+    FILE* list = fopen(locals, "w");
+    if (!list)
+    {
+        perror(locals);
+        exit(1);
+    }
+
+    for (int s = 0; s < nsizes; ++s)
+    {
+        buf = realloc(buf, sizes[s] ? sizes[s] : 1);
+        for (long i = 0; i < sizes[s]; ++i)
+            buf[i] = (char)rand();
+
+        for (int i = 0; i < nfiles; ++i)
+        {
+            struct stat st;
+            file_key(key, sizeof(key), sizes[s], i);
+            snprintf(path, sizeof(path), "%s%s", corpus, key);
+            fprintf(list, "%s %s\n", key, path);
+            if (0 == stat(path, &st) && st.st_size == sizes[s])
+                continue;
+
+            FILE* fp = fopen(path, "w");
+            if (!fp || fwrite(buf, 1, sizes[s], fp) != (size_t)sizes[s])
+            {
+                perror(path);
+                exit(1);
+            }
+            fclose(fp);
+        }
+    }
+    fclose(list);
+    free(buf);
+}
+
+/* returns once the daemon took the handshake, -1 if it never did */
+pid_t daemon_start(const char* daemon, int instance, cmd_chl_t* chl, 
+                   long nthreads, long mem)
+{
+    char threads[32], budget[32], idx[32];
+    snprintf(threads, sizeof(threads), "%ld", nthreads);
+    snprintf(budget, sizeof(budget), "%ld", mem);
+    snprintf(idx, sizeof(idx), "%d", instance);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl(daemon, daemon, "-t", threads, "-m", budget, "-c", locals,
+              "-n", idx, (char*)NULL);
+        perror(daemon);
+        _exit(127);
+    }
+
+    for (int waited = 0; pid > 0 && !cmd_synced(chl); waited += 10)
+    {
+        if (waited >= DAEMON_WAIT_MS || waitpid(pid, NULL, WNOHANG) != 0)
+        {
+            daemon_stop(pid);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return pid;
+}
+
+void daemon_stop(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+void* workercb(void* args)
+{
+    worker_t* self = args;
+    run_t*    run  = self->run;
+    long      n    = run->requests / run->nthreads + 
+                     (self->idx < run->requests % run->nthreads);
+    long      w    = run->warmup / run->nthreads;
+    char      key[64];
+
+    hdr_reset(&self->hdr);
+    for (long i = 0; i < w + n; ++i)
+    {
+        if (i == w)
+            pthread_barrier_wait(&run->warm);
+
+        gfcontext_t ctx = { 0, 0 };
+        file_key(key, sizeof(key), run->file_size,
+                 (self->idx + i * run->nthreads) % run->nfiles);
+
+        uint64_t start = hdr_now();
+        ssize_t  ret   = handle_with_cache(&ctx, key, &run->worker);
+        uint64_t took  = hdr_now() - start;
+
+        if (i < w)
+            continue;
+        if (ret < 0 || ctx.status != GF_OK || ctx.bytes != run->file_size)
+            __atomic_add_fetch(&run->errors, 1, __ATOMIC_RELAXED);
+        hdr_record(&self->hdr, took);
+    }
+    if (n == 0)
+        pthread_barrier_wait(&run->warm);
+    return NULL;
+}
+
+void run_one(run_t* run, FILE* out, const char* spec, long nseg, 
+             long dthreads)
+{
+    worker_t* workers = calloc(run->nthreads, sizeof(worker_t));
+    hdr_t*    total   = calloc(1, sizeof(hdr_t));
+
+    run->errors = 0;
+    pthread_barrier_init(&run->warm, NULL, run->nthreads + 1);
+    for (int i = 0; i < run->nthreads; ++i)
+    {
+        workers[i].run = run;
+        workers[i].idx = i;
+        pthread_create(&workers[i].thread_id, NULL, workercb, &workers[i]);
+    }
+    pthread_barrier_wait(&run->warm);
+    uint64_t start = hdr_now();
+    for (int i = 0; i < run->nthreads; ++i)
+    {
+        pthread_join(workers[i].thread_id, NULL);
+        hdr_merge(total, &workers[i].hdr);
+    }
+    double secs = (hdr_now() - start) / 1e9;
+    pthread_barrier_destroy(&run->warm);
+
+    fprintf(out, "{\"file_size\":%zu,\"segments\":\"%s\",\"segment_count\":%ld,"
+            "\"proxy_threads\":%d,\"daemons\":%d,\"daemon_threads\":%ld,"
+            "\"requests\":%llu,\"errors\":%ld,\"secs\":%.3f,\"rps\":%.1f,"
+            "\"mbps\":%.2f,",
+            run->file_size, spec, nseg, run->nthreads, run->ncaches, dthreads,
+            (unsigned long long)total->count, run->errors, secs,
+            total->count / secs, total->count * run->file_size / secs / 1e6);
+    hdr_json(total, out);
+    fprintf(out, "}\n");
+    fflush(out);
+
+    free(total);
+    free(workers);
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chash.h"
+
+/* splitmix64 finalizer, spreads a node's points over the whole ring */
+static uint64_t chash_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static int chash_cmp(const void* a, const void* b)
+{
+    const chash_point_t* pa = a;
+    const chash_point_t* pb = b;
+
+    if (pa->pos != pb->pos)
+        return (pa->pos < pb->pos) ? -1 : 1;
+    return (pa->node < pb->node) ? -1 : (pa->node > pb->node);
+}
+
+int chash_init(chash_t* ring, const uint64_t* keys, unsigned int nnodes)
+{
+    memset(ring, 0, sizeof(chash_t));
+    if (nnodes == 0)
+        return -1;
+
+    ring->points = malloc(nnodes * CHASH_VNODES * sizeof(chash_point_t));
+    ring->load   = calloc(nnodes, sizeof(unsigned int));
+    if (!ring->points || !ring->load)
+    {
+        chash_destroy(ring);
+        return -1;
+    }
+
+    for (unsigned int n = 0; n < nnodes; ++n)
+        for (unsigned int v = 0; v < CHASH_VNODES; ++v)
+        {
+            chash_point_t* pt = &ring->points[ring->npoints++];
+            pt->pos  = chash_mix(keys[n] + (v + 1) * 0x9e3779b97f4a7c15ULL);
+            pt->node = n;
+        }
+    qsort(ring->points, ring->npoints, sizeof(chash_point_t), chash_cmp);
+    ring->nnodes = nnodes;
+    return 0;
+}
+
+/*
+ * The loads are read racily, concurrent picks may push a node a request
+ * or two past its cap. Some node is always below it: the others' loads
+ * add up to less than nnodes caps.
+ */
+unsigned int chash_get(chash_t* ring, uint64_t hash)
+{
+    if (ring->nnodes <= 1)
+        return 0;
+
+    unsigned int total = __atomic_add_fetch(&ring->total, 1,
+                                            __ATOMIC_RELAXED);
+    unsigned int cap   = (unsigned int)(CHASH_SLACK * total / ring->nnodes)
+                         + 1;
+
+    /* first point at or past hash, the ring wraps to the start */
+    unsigned int lo = 0, hi = ring->npoints;
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].pos < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    unsigned int node = ring->points[lo % ring->npoints].node;
+    for (unsigned int i = 0; i < ring->npoints; ++i)
+    {
+        unsigned int cand = ring->points[(lo + i) % ring->npoints].node;
+        if (__atomic_load_n(&ring->load[cand], __ATOMIC_RELAXED) < cap)
+        {
+            node = cand;
+            break;
+        }
+    }
+    __atomic_add_fetch(&ring->load[node], 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+void chash_put(chash_t* ring, unsigned int node)
+{
+    if (ring->nnodes <= 1)
+        return;
+
+    __atomic_sub_fetch(&ring->load[node], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ring->total, 1, __ATOMIC_RELAXED);
+}
+
+void chash_destroy(chash_t* ring)
+{
+    free(ring->points);
+    free((void*)ring->load);
+    memset(ring, 0, sizeof(chash_t));
+}
@@ -0,0 +1,43 @@
+#ifndef CHASH_H
+#define CHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHASH_VNODES (128)
+#define CHASH_SLACK  (1.25)
+
+/*
+ * Consistent hashing with bounded loads, the proxy's map from path hash
+ * to simplecached instance. Every node owns CHASH_VNODES points on a
+ * 64-bit ring derived from its key alone, so adding or removing a node
+ * only moves the keys next to its own points, about 1/n of them. A key
+ * goes to the first node clockwise from it that has fewer requests in
+ * flight than CHASH_SLACK times its fair share; a hot slice spills over
+ * to the next nodes instead of queueing behind one.
+ */
+typedef struct chash_point_t
+{
+  uint64_t pos;
+  uint32_t node;
+} chash_point_t;
+
+typedef struct chash_t
+{
+  chash_point_t*          points;       /* sorted by pos */
+  unsigned int            npoints;
+  unsigned int            nnodes;
+  volatile unsigned int*  load;         /* requests in flight per node */
+  volatile unsigned int   total;
+} chash_t;
+
+/* Places nnodes nodes by their keys, e.g. the hash of a stable name */
+int chash_init(chash_t* ring, const uint64_t* keys, unsigned int nnodes);
+
+/* Picks the node for hash and counts a request on it until chash_put */
+unsigned int chash_get(chash_t* ring, uint64_t hash);
+void chash_put(chash_t* ring, unsigned int node);
+
+void chash_destroy(chash_t* ring);
+
+#endif
@@ -0,0 +1,389 @@
+#include <curl/curl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "curl_engine.h"
+#include "steque.h"
+
+#define MAX_LOOPS  (64)
+#define MAX_EVENTS (64)
+#define FETCH_BUF  (256 * 1024)
+
+typedef struct loop_t {
+    pthread_t        thread_id;
+    CURLM           *multi;
+    int              epfd;
+    int              evfd;
+    long             deadline;
+    pthread_mutex_t  mutex;
+    steque_t         adds;
+    steque_t         resumes;
+} loop_t;
+
+/*
+ * Hand-off between a loop thread and the worker blocked in
+ * engine_perform. The loop fills buf, the worker swaps it for its spare
+ * one; when buf is full the loop pauses the transfer until the worker
+ * has drained it and asks for a resume.
+ */
+typedef struct fetch_t {
+    CURL            *curl;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    char            *buf;
+    size_t           len;
+    size_t           cap;
+    int              paused;
+    int              aborted;
+    int              hdr_ready;
+    long             code;
+    curl_off_t       length;
+    int              done;
+    CURLcode         result;
+} fetch_t;
+
+static loop_t       loops[MAX_LOOPS];
+static int          nloops;
+static unsigned int next_loop;
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void loop_kick(loop_t *loop)
+{
+    uint64_t one = 1;
+    while (write(loop->evfd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+/* loop thread side of the hand-off ================================== */
+
+static size_t loop_headercb(char *buf, size_t size, size_t nmemb, void *arg)
+{
+    fetch_t *fetch = (fetch_t *)arg;
+    size_t   total = size * nmemb;
+    long     code  = 0;
+
+    if (total != 2 || memcmp(buf, "\r\n", 2))
+        return total;
+
+    curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code < 200)
+        return total;
+
+    pthread_mutex_lock(&fetch->mutex);
+    fetch->code = code;
+    curl_easy_getinfo(fetch->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &fetch->length);
+    fetch->hdr_ready = 1;
+    pthread_cond_signal(&fetch->cond);
+    pthread_mutex_unlock(&fetch->mutex);
+    return total;
+}
+
+static size_t loop_writecb(void *buf, size_t size, size_t nmemb, void *arg)
+{
+    fetch_t *fetch = (fetch_t *)arg;
+    size_t   total = size * nmemb;
+
+    pthread_mutex_lock(&fetch->mutex);
+    if (fetch->aborted)
+    {
+        pthread_mutex_unlock(&fetch->mutex);
+        return 0;
+    }
+
+    if (fetch->len + total > fetch->cap)
+    {
+        if (fetch->len)
+        {
+            fetch->paused = 1;
+            pthread_mutex_unlock(&fetch->mutex);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        char *grown = realloc(fetch->buf, total);
+        if (!grown)
+        {
+            pthread_mutex_unlock(&fetch->mutex);
+            return 0;
+        }
+        fetch->buf = grown;
+        fetch->cap = total;
+    }
+
+    memcpy(fetch->buf + fetch->len, buf, total);
+    fetch->len += total;
+    pthread_cond_signal(&fetch->cond);
+    pthread_mutex_unlock(&fetch->mutex);
+    return total;
+}
+
+static int loop_socketcb(CURL *curl, curl_socket_t s, int what, void *arg,
+                         void *socketp)
+{
+    loop_t             *loop = (loop_t *)arg;
+    struct epoll_event  ev;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    ev.events  = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                 ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+
+    if (!socketp)
+    {
+        curl_multi_assign(loop->multi, s, loop);
+        if (0 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) ||
+            errno != EEXIST)
+            return 0;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s, &ev);
+    return 0;
+}
+
+static int loop_timercb(CURLM *multi, long timeout_ms, void *arg)
+{
+    loop_t *loop = (loop_t *)arg;
+
+    loop->deadline = (timeout_ms < 0) ? -1 : now_ms() + timeout_ms;
+    return 0;
+}
+
+static void loop_reap(loop_t *loop)
+{
+    CURLMsg *msg;
+    int      pending;
+
+    while ((msg = curl_multi_info_read(loop->multi, &pending)))
+    {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        fetch_t *fetch  = NULL;
+        CURL    *curl   = msg->easy_handle;
+        CURLcode result = msg->data.result;
+
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&fetch);
+        curl_multi_remove_handle(loop->multi, curl);
+
+        // the worker may return and drop fetch as soon as it sees done
+        pthread_mutex_lock(&fetch->mutex);
+        fetch->result = result;
+        fetch->done   = 1;
+        pthread_cond_signal(&fetch->cond);
+        pthread_mutex_unlock(&fetch->mutex);
+    }
+}
+
+static void loop_drain(loop_t *loop)
+{
+    uint64_t count;
+    int      running;
+
+    while (read(loop->evfd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&loop->mutex);
+    while (!steque_isempty(&loop->adds))
+        curl_multi_add_handle(loop->multi, steque_pop(&loop->adds));
+    while (!steque_isempty(&loop->resumes))
+        curl_easy_pause(steque_pop(&loop->resumes), CURLPAUSE_CONT);
+    pthread_mutex_unlock(&loop->mutex);
+
+    curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+}
+
+static void *loop_run(void *arg)
+{
+    loop_t             *loop = (loop_t *)arg;
+    struct epoll_event  events[MAX_EVENTS];
+    int                 running;
+
+    while (1)
+    {
+        int wait = -1;
+        if (loop->deadline >= 0)
+        {
+            long left = loop->deadline - now_ms();
+            wait = (left > 0) ? (int)left : 0;
+        }
+
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, wait);
+        for (int i = 0; i < n; ++i)
+        {
+            if (events[i].data.fd == loop->evfd)
+            {
+                loop_drain(loop);
+                continue;
+            }
+
+            int flags = 0;
+            if (events[i].events & EPOLLIN)
+                flags |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                flags |= CURL_CSELECT_OUT;
+            if (events[i].events & (EPOLLERR|EPOLLHUP))
+                flags |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(loop->multi, events[i].data.fd, flags,
+                                     &running);
+        }
+
+        if (loop->deadline >= 0 && now_ms() >= loop->deadline)
+        {
+            loop->deadline = -1;
+            curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0,
+                                     &running);
+        }
+        loop_reap(loop);
+    }
+    return NULL;
+}
+
+int engine_init(int count)
+{
+    struct epoll_event ev;
+
+    if (count > MAX_LOOPS)
+        count = MAX_LOOPS;
+
+    for (nloops = 0; nloops < count; ++nloops)
+    {
+        loop_t *loop = &loops[nloops];
+
+        loop->deadline = -1;
+        loop->multi    = curl_multi_init();
+        loop->epfd     = epoll_create1(EPOLL_CLOEXEC);
+        loop->evfd     = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (!loop->multi || loop->epfd < 0 || loop->evfd < 0)
+            return -1;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events  = EPOLLIN;
+        ev.data.fd = loop->evfd;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev);
+
+        pthread_mutex_init(&loop->mutex, NULL);
+        steque_init(&loop->adds);
+        steque_init(&loop->resumes);
+
+        curl_multi_setopt(loop->multi, CURLMOPT_SOCKETFUNCTION, loop_socketcb);
+        curl_multi_setopt(loop->multi, CURLMOPT_SOCKETDATA, loop);
+        curl_multi_setopt(loop->multi, CURLMOPT_TIMERFUNCTION, loop_timercb);
+        curl_multi_setopt(loop->multi, CURLMOPT_TIMERDATA, loop);
+
+        if (pthread_create(&loop->thread_id, NULL, loop_run, loop))
+            return -1;
+    }
+    return 0;
+}
+
+int engine_active()
+{
+    return nloops > 0;
+}
+
+/* worker side of the hand-off ======================================= */
+
+static void loop_post(loop_t *loop, steque_t *queue, CURL *curl)
+{
+    pthread_mutex_lock(&loop->mutex);
+    steque_enqueue(queue, curl);
+    pthread_mutex_unlock(&loop->mutex);
+    loop_kick(loop);
+}
+
+CURLcode engine_perform(CURL *curl, engine_hdr_fn on_hdr,
+                        engine_data_fn on_data, void *arg)
+{
+    fetch_t  fetch;
+    char    *spare     = malloc(FETCH_BUF);
+    size_t   spare_cap = FETCH_BUF;
+    loop_t  *loop      = &loops[__atomic_fetch_add(&next_loop, 1,
+                                   __ATOMIC_RELAXED) % nloops];
+
+    memset(&fetch, 0, sizeof(fetch));
+    fetch.curl = curl;
+    fetch.buf  = malloc(FETCH_BUF);
+    fetch.cap  = FETCH_BUF;
+    if (!spare || !fetch.buf)
+    {
+        free(spare);
+        free(fetch.buf);
+        return CURLE_OUT_OF_MEMORY;
+    }
+    pthread_mutex_init(&fetch.mutex, NULL);
+    pthread_cond_init(&fetch.cond, NULL);
+
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, loop_headercb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&fetch);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, loop_writecb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&fetch);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)&fetch);
+    loop_post(loop, &loop->adds, curl);
+
+    pthread_mutex_lock(&fetch.mutex);
+    while (1)
+    {
+        if (fetch.hdr_ready)
+        {
+            long       code   = fetch.code;
+            curl_off_t length = fetch.length;
+            fetch.hdr_ready = 0;
+            pthread_mutex_unlock(&fetch.mutex);
+            on_hdr(arg, code, length);
+            pthread_mutex_lock(&fetch.mutex);
+        }
+        else if (fetch.len)
+        {
+            char   *data    = fetch.buf;
+            size_t  len     = fetch.len;
+            size_t  cap     = fetch.cap;
+            int     resume  = fetch.paused;
+            fetch.buf    = spare;
+            fetch.cap    = spare_cap;
+            fetch.len    = 0;
+            fetch.paused = 0;
+            pthread_mutex_unlock(&fetch.mutex);
+
+            if (resume)
+                loop_post(loop, &loop->resumes, curl);
+            if (on_data(arg, data, len) != len)
+            {
+                pthread_mutex_lock(&fetch.mutex);
+                fetch.aborted = 1;
+                pthread_mutex_unlock(&fetch.mutex);
+            }
+            spare     = data;
+            spare_cap = cap;
+            pthread_mutex_lock(&fetch.mutex);
+        }
+        else if (fetch.done)
+            break;
+        else
+            pthread_cond_wait(&fetch.cond, &fetch.mutex);
+    }
+    pthread_mutex_unlock(&fetch.mutex);
+
+    pthread_cond_destroy(&fetch.cond);
+    pthread_mutex_destroy(&fetch.mutex);
+    free(fetch.buf);
+    free(spare);
+    return fetch.result;
+}
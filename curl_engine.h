@@ -0,0 +1,28 @@
+#ifndef CURL_ENGINE_H
+#define CURL_ENGINE_H
+
+#include <curl/curl.h>
+
+/*
+ * Event driven fetch engine. A few loop threads drive every transfer
+ * through curl_multi_socket_action and epoll; the thread that called
+ * engine_perform only wakes up for the header and for each chunk.
+ */
+typedef void   (*engine_hdr_fn)(void *arg, long code, curl_off_t length);
+typedef size_t (*engine_data_fn)(void *arg, const void *buf, size_t len);
+
+/* Starts nloops event loop threads, zero leaves the engine off */
+int engine_init(int nloops);
+
+/* Returns 1 once engine_init started at least one loop */
+int engine_active();
+
+/*
+ * Drop-in for curl_easy_perform. on_hdr runs once the header block of
+ * the final response is in, on_data for every body chunk, both on the
+ * calling thread. The handle's header/write callbacks are overwritten.
+ */
+CURLcode engine_perform(CURL *curl, engine_hdr_fn on_hdr,
+                        engine_data_fn on_data, void *arg);
+
+#endif
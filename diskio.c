@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "diskio.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define DIO_URING
+#endif
+#endif
+
+typedef struct dio_t
+{
+    int       state;            /* 0 untouched, 1 io_uring, -1 pread */
+    unsigned  queued;
+    unsigned  inflight;
+#ifdef DIO_URING
+    int       ring_fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+#endif
+    /* completed reads of the pread fallback */
+    unsigned  ndone;
+    uint64_t  done_tag[DIO_DEPTH];
+    ssize_t   done_res[DIO_DEPTH];
+} dio_t;
+
+static __thread dio_t dio;
+
+#ifdef DIO_URING
+/* setup alone proves nothing, IORING_OP_READ only came with 5.6 */
+static int uring_can_read(int fd)
+{
+#ifdef IO_URING_OP_SUPPORTED
+    size_t                  size  = sizeof(struct io_uring_probe) +
+                                    256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe*  probe = calloc(1, size);
+    int                     ok    = 0;
+
+    if (probe && 0 == syscall(__NR_io_uring_register, fd,
+                              IORING_REGISTER_PROBE, probe, 256))
+        ok = probe->last_op >= IORING_OP_READ &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+static int uring_setup()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, DIO_DEPTH, &p);
+    if (fd < 0)
+        return -1;
+    if (!uring_can_read(fd))
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_sz = cq_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+
+    char* sq = mmap(NULL, sq_sz, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_sz, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    dio.ring_fd  = fd;
+    dio.sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    dio.sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    dio.sq_array = (unsigned*)(sq + p.sq_off.array);
+    dio.cq_head  = (unsigned*)(cq + p.cq_off.head);
+    dio.cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    dio.cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    dio.sqes     = sqes;
+    dio.cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+#endif
+
+static void dio_setup()
+{
+    dio.state = -1;
+#ifdef DIO_URING
+    if (0 == uring_setup())
+        dio.state = 1;
+#endif
+}
+
+int dio_read(int fd, void* buf, size_t len, off_t off, uint64_t tag)
+{
+    if (!dio.state)
+        dio_setup();
+    if (dio.queued + dio.inflight + dio.ndone >= DIO_DEPTH)
+        return -1;
+
+#ifdef DIO_URING
+    if (dio.state == 1)
+    {
+        unsigned tail = *dio.sq_tail;
+        unsigned idx  = tail & *dio.sq_mask;
+        struct io_uring_sqe* sqe = &dio.sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = IORING_OP_READ;
+        sqe->fd        = fd;
+        sqe->addr      = (uintptr_t)buf;
+        sqe->len       = len;
+        sqe->off       = off;
+        sqe->user_data = tag;
+        dio.sq_array[idx] = idx;
+        __atomic_store_n(dio.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        dio.queued++;
+        return 0;
+    }
+#endif
+
+    ssize_t res = pread(fd, buf, len, off);
+    dio.done_tag[dio.ndone] = tag;
+    dio.done_res[dio.ndone] = (res < 0) ? -errno : res;
+    dio.ndone++;
+    return 0;
+}
+
+int dio_wait(uint64_t* tag, ssize_t* res)
+{
+    if (dio.ndone)
+    {
+        dio.ndone--;
+        *tag = dio.done_tag[dio.ndone];
+        *res = dio.done_res[dio.ndone];
+        return 0;
+    }
+
+#ifdef DIO_URING
+    if (dio.state == 1 && (dio.queued || dio.inflight))
+    {
+        /* reads queued since the last wait go out before a reap */
+        if (dio.queued)
+        {
+            int ret = syscall(__NR_io_uring_enter, dio.ring_fd, dio.queued,
+                              0, 0, NULL, 0);
+            if (ret > 0)
+            {
+                dio.inflight += ret;
+                dio.queued   -= ret;
+            }
+        }
+
+        unsigned head = *dio.cq_head;
+        while (head == __atomic_load_n(dio.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            int ret = syscall(__NR_io_uring_enter, dio.ring_fd, dio.queued,
+                              1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR)
+                return -1;
+            if (ret > 0)
+            {
+                dio.inflight += ret;
+                dio.queued   -= ret;
+            }
+        }
+
+        struct io_uring_cqe* cqe = &dio.cqes[head & *dio.cq_mask];
+        *tag = cqe->user_data;
+        *res = cqe->res;
+        __atomic_store_n(dio.cq_head, head + 1, __ATOMIC_RELEASE);
+        dio.inflight--;
+        return 0;
+    }
+#endif
+    return -1;
+}
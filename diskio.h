@@ -0,0 +1,23 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define DIO_DEPTH (16)
+
+/*
+ * Per thread read engine for simplecached. Reads go through a private
+ * io_uring (raw syscalls, no liburing) so a worker can keep several in
+ * flight; where io_uring is missing, refused or cannot read yet (before
+ * 5.6) they are done with pread on the spot and complete on the next
+ * dio_wait.
+ */
+
+/* Queues a read of len bytes at off into buf, -1 once DIO_DEPTH are out */
+int dio_read(int fd, void* buf, size_t len, off_t off, uint64_t tag);
+
+/* Submits queued reads and returns one completion, -1 when none is out */
+int dio_wait(uint64_t* tag, ssize_t* res);
+
+#endif
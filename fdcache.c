@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fdcache.h"
+#include "objcache.h"
+#include "pathidx.h"
+#include "simplecache.h"
+
+#define FD_CAPACITY (1024)
+
+static pthread_rwlock_t fd_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t   fd_once = PTHREAD_ONCE_INIT;
+static pidx_t           fd_index;
+
+static void fd_init()
+{
+    pidx_init(&fd_index, FD_CAPACITY);
+}
+
+static time_t fd_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+static int fd_stat(fdent_t* ent)
+{
+    struct statx stx;
+    if (statx(ent->fd, "", AT_EMPTY_PATH, 
+              STATX_SIZE|STATX_MTIME, &stx))
+        return -1;
+
+    ent->size          = stx.stx_size;
+    ent->mtime.tv_sec  = stx.stx_mtime.tv_sec;
+    ent->mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+    ent->checked       = fd_now();
+    return 0;
+}
+
+/* a changed file also takes its resident copy out of the object cache */
+static void fd_recheck(fdent_t* ent)
+{
+    size_t          size  = ent->size;
+    struct timespec mtime = ent->mtime;
+
+    if (fd_stat(ent))
+        return;
+    if (size != ent->size || mtime.tv_sec != ent->mtime.tv_sec ||
+        mtime.tv_nsec != ent->mtime.tv_nsec)
+        objcache_drop(ent->path, ent->hash);
+}
+
+int fdcache_get(const char* path, uint64_t hash, size_t* size)
+{
+    int fd = -1;
+
+    pthread_once(&fd_once, fd_init);
+    pthread_rwlock_rdlock(&fd_lock);
+    fdent_t* ent = pidx_find(&fd_index, hash, path);
+    if (ent && fd_now() - ent->checked < FD_TTL)
+    {
+        fd    = ent->fd;
+        *size = ent->size;
+    }
+    pthread_rwlock_unlock(&fd_lock);
+    if (fd != -1)
+        return fd;
+
+    pthread_rwlock_wrlock(&fd_lock);
+    if (NULL != (ent = pidx_find(&fd_index, hash, path)))
+    {
+        if (fd_now() - ent->checked >= FD_TTL)
+            fd_recheck(ent);
+        goto done;
+    }
+
+    /* paths too long for an entry are served, just not remembered, and
+     * so are all when there is no memory for one */
+    fdent_t probe;
+    probe.fd = simplecache_get((char*)path);
+    if (probe.fd == -1 || fd_stat(&probe))
+        goto done;
+    posix_fadvise(probe.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (strlen(path) >= FD_PATHLEN || NULL == (ent = malloc(sizeof(fdent_t))))
+    {
+        fd    = probe.fd;
+        *size = probe.size;
+        goto done;
+    }
+
+    *ent = probe;
+    strcpy(ent->path, path);
+    ent->hash = hash;
+    pidx_insert(&fd_index, hash, ent);
+
+  done:
+    if (ent)
+    {
+        fd    = ent->fd;
+        *size = ent->size;
+    }
+    pthread_rwlock_unlock(&fd_lock);
+    return fd;
+}
+
+/* the descriptors belong to simplecache, only the entries go */
+void fdcache_destroy()
+{
+    fdent_t* ent;
+    size_t   pos = 0;
+
+    pthread_once(&fd_once, fd_init);
+    pthread_rwlock_wrlock(&fd_lock);
+    while (NULL != (ent = pidx_next(&fd_index, &pos)))
+        free(ent);
+    pidx_destroy(&fd_index);
+    pthread_rwlock_unlock(&fd_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FD_PATHLEN (128)
+#define FD_TTL     (1)
+
+/*
+ * Open file metadata for simplecached, keyed by request path. The
+ * descriptor is simplecache's own and is shared by every reader, which
+ * is why all reads go through pread. Entries are rechecked with a statx
+ * of the descriptor at most every FD_TTL seconds, so a hit costs no
+ * syscall at all. That catches files changed in place; simplecache keeps
+ * its descriptor, so a file replaced by rename is not seen.
+ */
+typedef struct fdent_t
+{
+  char            path[FD_PATHLEN];
+  int             fd;
+  size_t          size;
+  struct timespec mtime;
+  time_t          checked;
+  uint64_t        hash;
+} fdent_t;
+
+/* Returns the descriptor for path and its size, -1 when there is none */
+int fdcache_get(const char* path, uint64_t hash, size_t* size);
+
+void fdcache_destroy();
+
+#endif
@@ -11,125 +11,715 @@
 #include <printf.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <semaphore.h>
 #include <pthread.h>
 #include <sys/mman.h>
 
 #include "gfserver.h"
-#include "steque.h"
+#include "mpmcq.h"
 #include "shm_channel.h"
+#include "hotcache.h"
+#include "stats.h"
+#include "chash.h"
+#include "proxy-student.h"
 
-#define BUFSIZE (4096)
+#define MAPCHUNK (1 << 20)
 
-pthread_mutex_t shmq_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  shmq_cond  = PTHREAD_COND_INITIALIZER;
-steque_t        shmq;
+#define MAX_CLASSES (8)
+#define SIZE_HINTS  (4096)
+#define POOL_MAX    (4096)
+#define SEG_AUTO    (1 << 20)
+#define SEG_WAIT_MS (50)
+#define TUNE_PERIOD (4096)
+#define TUNE_IDLE   (2)
+#define SEG_DEADLINE (1000)
+
+/* cache_fetch gave up before anything reached the client */
+#define FETCH_SHED  (-2)
+/* the daemon stalled mid-transfer, the segment is not ours to reuse */
+#define FETCH_STALL (-3)
+
+/* 
+ * segment pools, one per size class, smallest first. segsize moves when
+ * seg_tune re-classes; segments of the old size still out are freed as
+ * they come back, shm_enq no longer finds their class.
+ */
+typedef struct seg_class_t
+{
+    volatile size_t        segsize;
+    size_t                 pending;     /* seg_tune's last vote */
+    volatile unsigned long starved;     /* carved, borrowed or waited */
+    mpmcq_t                pool;
+} seg_class_t;
+
+typedef struct size_hint_t
+{
+    uint64_t key;
+    size_t   size;
+} size_hint_t;
+
+seg_class_t     seg_classes[MAX_CLASSES];
+int             nclasses;
+size_t          seg_ceiling;
+size_hint_t     size_hints[SIZE_HINTS];
+int             fd_chl = -1;
+
+/* responses by the arena order a segment would need to inline them */
+unsigned long   size_hist[ARENA_ORDERS];
+unsigned long   tune_ticks;
+pthread_mutex_t tune_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* abandoned segments the daemon may still write to, see seg_reclaim */
+mpmcq_t         limbo;
+int             seg_wait_ms   = SEG_DEADLINE;
+int             reply_wait_ms = SHM_TIMEOUT;
+
+/* path hash to simplecached instance, a single one takes everything */
+chash_t         shards;
+unsigned int    nshards = 1;
 
 void shm_init(unsigned int num_seg, unsigned int segsize);
+int shm_init_classes(const char* spec, unsigned int num_seg);
+int shm_add_class(size_t segsize, unsigned int num_seg);
+int shm_pools_init(size_t* sizes, unsigned long* counts, int n);
 void cleanup();
-shm_t* shm_deq();
+shm_t* shm_deq(size_t hint, int timeout_ms);
 void shm_enq(shm_t*);
+void seg_abandon(shm_t*);
+void seg_reclaim();
+size_t size_hint_get(uint64_t hash);
+void size_hint_put(uint64_t hash, size_t size);
+void seg_observe(size_t file_size);
+void seg_tune();
+size_t seg_quantile(unsigned long* hist, unsigned long total, double q);
+ssize_t cache_fetch(gfcontext_t*, const char*, size_t, uint64_t, cmd_chl_t*,
+                    uint64_t*);
+ssize_t recv_chunks(gfcontext_t*, cache_t*, size_t);
+ssize_t recv_ring(gfcontext_t*, ring_t*, size_t);
+ssize_t send_mapped(gfcontext_t*, int fd, size_t);
 
 ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg)
 {
-    struct timespec ts;
-    char buffer[BUFSIZE];
-    strcpy(buffer, path);
+    cache_worker_t* worker  = arg;
+    uint64_t        replied = 0;
+    uint64_t        start   = stats_now();
+    size_t          len     = strlen(path);
+    uint64_t        hash    = path_hash(path, len);
+    unsigned int    shard   = chash_get(&shards, hash);
+    ssize_t         ret     = cache_fetch(ctx, path, len, hash, 
+                                          worker->chl[shard], &replied);
+    chash_put(&shards, shard);
+
+    /* nothing went out yet, the request can still be served elsewhere */
+    if (ret == FETCH_SHED && worker->fallback)
+    {
+        stats_count(C_FALLBACK, 1);
+        ret = worker->fallback(ctx, path, worker->fallback_arg);
+    }
+    else if (ret == FETCH_SHED)
+    {
+        stats_count(C_SHED, 1);
+        ret = hot_sendheader(ctx, GF_ERROR, 0);
+    }
 
-    mqd_t cmd_chl = (mqd_t)((intptr_t)arg);
-    shm_t* shm = shm_deq();
+    if (replied)
+        stats_stage(ST_BODY, replied);
+    stats_stage(ST_REQUEST, start);
+    stats_count(C_REQUESTS, 1);
+    if (ret > 0)
+        stats_count(C_BYTES, ret);
+    else if (ret < 0)
+        stats_count(C_ERRORS, 1);
+    return ret;
+}
 
-    char* shmnm = shm->seg_name;
-    size_t shmsz = shm->seg_size;
+void cache_timeouts(int seg_wait, int reply_wait)
+{
+    seg_wait_ms   = seg_wait;
+    reply_wait_ms = reply_wait;
+}
 
-    sem_t* semr = sem_create(shm->seg_name, READER);
-    sem_t* semw = sem_create(shm->seg_name, WRITER);
+/* 
+ * Instances sit on the ring by their queue's name, so growing from n to
+ * n + 1 daemons moves only the keys the new one takes over.
+ */
+int cache_shards(unsigned int ncaches)
+{
+    if (ncaches == 0) 
+        return -1;
 
-    req_send(cmd_chl, buffer, shmnm, shmsz);
+    uint64_t keys[ncaches];
+    char     name[NAME_MAX];
 
-    clock_gettime(CLOCK_REALTIME, &ts);
-    ts.tv_sec += 20;
-    if (-1 == sem_timedwait(semr, &ts))
-        exit(SERVER_FAILURE);
+    for (unsigned int idx = 0; idx < ncaches; ++idx) 
+    {
+        cmd_name(name, sizeof(name), CMD_MSG_Q, idx);
+        keys[idx] = path_hash(name, strlen(name));
+    }
+    chash_destroy(&shards);
+    if (chash_init(&shards, keys, ncaches)) 
+        return -1;
+    nshards = ncaches;
+    return 0;
+}
+
+/* 
+ * *replied is when the header came in, left alone unless FILE_FOUND.
+ * Returns FETCH_SHED when no segment or no reply came in time.
+ */
+ssize_t cache_fetch(gfcontext_t *ctx, const char *path, size_t len, 
+                    uint64_t hash, cmd_chl_t* cmd_chl, uint64_t* replied)
+{
+    if (len >= MAX_REQUEST_LEN)
+    {
+        stats_count(C_NOT_FOUND, 1);
+        return hot_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
+
+    uint64_t t = stats_now();
+    shm_t* shm = shm_deq(size_hint_get(hash), seg_wait_ms);
+    t = stats_stage(ST_SEG_WAIT, t);
+    if (!shm)
+    {
+        stats_count(C_SEG_TIMEOUT, 1);
+        return FETCH_SHED;
+    }
+
+    cache_t* pcache = shm_getdata(shm);
+    pcache->gen++;
+
+    unsigned int xfer_mask = XFER_CHUNK|XFER_RING|XFER_INLINE;
+    if (fd_chl >= 0)
+        xfer_mask |= XFER_FD;
+    if (req_send(cmd_chl, path, len, hash, shm->seg_off, shm->seg_size,
+                 xfer_mask, reply_wait_ms))
+    {
+        shm_enq(shm);
+        return FETCH_SHED;
+    }
+    t = stats_stage(ST_SUBMIT, t);
+
+    if (-1 == shm_wait(&pcache->reader, reply_wait_ms))
+    {
+        seg_abandon(shm);
+        return FETCH_SHED;
+    }
+    t = stats_stage(ST_REPLY, t);
 
-    cache_t* pcache  = shm_getdata(shm);
     size_t file_size = pcache->file_size;
     status_t status  = pcache->status;
+    if (status == FILE_FOUND)
+    {
+        size_hint_put(hash, file_size);
+        seg_observe(file_size);
+        *replied = t;
+    }
 
     if (status == FILE_NOT_FOUND)
     {
+        stats_count(C_NOT_FOUND, 1);
+        shm_post(&pcache->writer);
+        shm_enq(shm);
+        return hot_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
+
+    if (status == ERROR)
+    {
+        stats_count(C_ERRORS, 1);
+        shm_post(&pcache->writer);
+        shm_enq(shm);
+        return hot_sendheader(ctx, GF_ERROR, 0);
+    }
+
+    /* the payload came with the header, no second round trip */
+    if (pcache->xfer == XFER_INLINE)
+    {
+        stats_count(C_XFER_INLINE, 1);
+        hot_sendheader(ctx, GF_OK, file_size);
+        ssize_t sent = hot_send(ctx, cache_get_data(pcache), file_size);
+        shm_post(&pcache->writer);
         shm_enq(shm);
-        sem_post(semw);
-        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+        return (sent == file_size) ? sent : -1;
+    }
+
+    /* the segment is not needed past the header, release it early */
+    if (pcache->xfer == XFER_FD)
+    {
+        stats_count(C_XFER_FD, 1);
+        int fd = fd_recv(fd_chl, shm);
+        shm_post(&pcache->writer);
+        shm_enq(shm);
+        if (fd < 0)
+            return FETCH_SHED;
+
+        hot_sendheader(ctx, GF_OK, file_size);
+        return send_mapped(ctx, fd, file_size);
     }
     
-    gfs_sendheader(ctx, GF_OK, file_size);
-    sem_post(semw);
+    hot_sendheader(ctx, GF_OK, file_size);
 
-    size_t transferred = 0;
-    void* data = cache_get_data(pcache);
+    ssize_t transferred;
+    if (pcache->xfer == XFER_RING)
+    {
+        stats_count(C_XFER_RING, 1);
+        transferred = recv_ring(ctx, ring_get(pcache), file_size);
+    }
+    else
+    {
+        stats_count(C_XFER_CHUNK, 1);
+        shm_post(&pcache->writer);
+        transferred = recv_chunks(ctx, pcache, file_size);
+    }
+    if (transferred == FETCH_STALL)
+    {
+        seg_abandon(shm);
+        return -1;
+    }
+    shm_post(&pcache->writer);
+    shm_enq(shm);
+    return transferred;
+}
+
+/* 
+ * Both receivers keep draining after a failed gfs_send so the daemon
+ * is done with the segment before it goes back to the pool.
+ */
+ssize_t recv_chunks(gfcontext_t *ctx, cache_t* pcache, size_t file_size)
+{
+    ssize_t ret         = 0;
+    size_t  transferred = 0;
+    void*   data        = cache_get_data(pcache);
     while(transferred < file_size) 
     {
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 20;
-        if (-1 == sem_timedwait(semr, &ts))
-            exit(SERVER_FAILURE);
-
-        size_t chksz    = pcache->chunk_size;
-        ssize_t written = gfs_send(ctx, data, chksz);
-        if (written != chksz) 
-        {e
-            shm_enq(shm);
-            sem_post(semw);
+        if (-1 == shm_wait(&pcache->reader, reply_wait_ms))
+            return FETCH_STALL;
+
+        if (pcache->status == ERROR)
             return -1;
+
+        size_t chksz = pcache->chunk_size;
+        if (ret == 0 && hot_send(ctx, data, chksz) != chksz) 
+            ret = -1;
+        transferred += chksz;
+        shm_post(&pcache->writer);
+    }
+    return ret ? ret : (ssize_t)transferred;
+}
+
+ssize_t recv_ring(gfcontext_t *ctx, ring_t* ring, size_t file_size)
+{
+    ssize_t ret         = 0;
+    size_t  transferred = 0;
+    while(transferred < file_size) 
+    {
+        size_t chksz;
+        void*  data = ring_consume(ring, &chksz, reply_wait_ms);
+        if (!data)
+            return FETCH_STALL;
+
+        if (chksz == 0)
+            return -1;
+
+        if (ret == 0 && hot_send(ctx, data, chksz) != chksz) 
+            ret = -1;
+        transferred += chksz;
+        ring_release(ring);
+    }
+    return ret ? ret : (ssize_t)transferred;
+}
+
+/* 
+ * Serves straight from the daemon's page cache pages; the only copy
+ * left is the one into the client socket.
+ */
+ssize_t send_mapped(gfcontext_t *ctx, int fd, size_t file_size)
+{
+    void* map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, file_size, MADV_SEQUENTIAL);
+
+    size_t transferred = 0;
+    while(transferred < file_size) 
+    {
+        size_t remained = (file_size - transferred);
+        size_t chksz    = (remained < MAPCHUNK) ? remained : MAPCHUNK;
+        if (hot_send(ctx, (char*)map + transferred, chksz) != chksz)
+            break;
+        transferred += chksz;
+    }
+    munmap(map, file_size);
+    return (transferred == file_size) ? (ssize_t)transferred : -1;
+}
+
+/* 
+ * Last seen size per path, direct mapped and lossy, so shm_deq can pick
+ * a segment class before the daemon has answered.
+ */
+size_t size_hint_get(uint64_t hash) 
+{
+    size_hint_t* hint = &size_hints[hash % SIZE_HINTS];
+
+    return (hint->key == hash) ? hint->size : 0;
+}
+
+void size_hint_put(uint64_t hash, size_t size) 
+{
+    size_hint_t* hint = &size_hints[hash % SIZE_HINTS];
+
+    hint->key  = hash;
+    hint->size = size;
+}
+
+/* 
+ * Every found response lands in size_hist; every TUNE_PERIOD of them one
+ * of the threads that gets past the trylock runs seg_tune.
+ */
+void seg_observe(size_t file_size) 
+{
+    size_t order = 0;
+    size_t block = arena_block(sizeof(shm_t) + sizeof(cache_t) + file_size);
+    while ((ARENA_MIN_BLOCK << order) < block && order < ARENA_ORDERS - 1) 
+        order++;
+    __atomic_add_fetch(&size_hist[order], 1, __ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&tune_ticks, 1, __ATOMIC_RELAXED) % TUNE_PERIOD 
+        == 0 && 0 == pthread_mutex_trylock(&tune_mutex)) 
+    {
+        seg_tune();
+        pthread_mutex_unlock(&tune_mutex);
+    }
+}
+
+/* smallest segment size that inlines a q share of the responses */
+size_t seg_quantile(unsigned long* hist, unsigned long total, double q) 
+{
+    unsigned long seen = 0;
+    for (int order = 0; order < ARENA_ORDERS; ++order) 
+    {
+        seen += hist[order];
+        if (seen >= q * total) 
+            return (size_t)ARENA_MIN_BLOCK << order;
+    }
+    return (size_t)ARENA_MIN_BLOCK << (ARENA_ORDERS - 1);
+}
+
+/* 
+ * Re-classes and trims the pools from what the last periods looked
+ * like. Class i is sized to inline the 0.95 * (i + 1) / n quantile of
+ * the responses, below seg_ceiling and each at least twice the one
+ * before; a class only moves once two passes in a row agree. Classes
+ * that were not short of segments hand half of their idle ones beyond
+ * TUNE_IDLE back to the arena, where shm_deq carves them for the
+ * classes that are. The histogram decays by half every pass.
+ */
+void seg_tune() 
+{
+    unsigned long hist[ARENA_ORDERS];
+    unsigned long total = 0;
+    size_t        target[MAX_CLASSES];
+    int           n = nclasses;
+
+    for (int order = 0; order < ARENA_ORDERS; ++order) 
+    {
+        hist[order] = __atomic_load_n(&size_hist[order], __ATOMIC_RELAXED);
+        __atomic_store_n(&size_hist[order], hist[order] / 2, 
+                         __ATOMIC_RELAXED);
+        total += hist[order];
+    }
+
+    for (int i = 0; i < n; ++i) 
+        target[i] = seg_quantile(hist, total, 0.95 * (i + 1) / n);
+    for (int i = 1; i < n; ++i) 
+        if (target[i] < 2 * target[i-1]) 
+            target[i] = 2 * target[i-1];
+    for (int i = n - 1; i >= 0; --i) 
+    {
+        size_t cap = (i == n - 1) ? seg_ceiling : target[i+1] / 2;
+        if (target[i] > cap) 
+            target[i] = cap;
+    }
+    if (n == 0 || target[0] < ARENA_MIN_BLOCK || total < TUNE_PERIOD / 4) 
+        n = 0;
+    seg_reclaim();
+
+    /* classes move together or not at all, the order must hold */
+    size_t next[MAX_CLASSES];
+    int    sorted = 1;
+    for (int i = 0; i < nclasses; ++i) 
+    {
+        seg_class_t* cls = &seg_classes[i];
+        int          vote = (i < n && target[i] != cls->segsize);
+
+        next[i] = (vote && cls->pending == target[i]) ? target[i] : 
+                                                         cls->segsize;
+        cls->pending = vote ? target[i] : 0;
+        if (i > 0 && next[i] <= next[i-1]) 
+            sorted = 0;
+    }
+
+    for (int i = 0; i < nclasses; ++i) 
+    {
+        seg_class_t* cls = &seg_classes[i];
+        shm_t*       shm;
+        int          drop = 0;
+
+        if (sorted && next[i] != cls->segsize) 
+        {
+            __atomic_store_n(&cls->segsize, next[i], __ATOMIC_RELEASE);
+            stats_count(C_SEG_RECLASSED, 1);
+            drop = mpmcq_size(&cls->pool);
+        }
+
+        if (0 == __atomic_exchange_n(&cls->starved, 0, __ATOMIC_RELAXED) &&
+            drop == 0) 
+        {
+            int idle = mpmcq_size(&cls->pool);
+            if (idle > TUNE_IDLE) 
+                drop = (idle - TUNE_IDLE + 1) / 2;
+        }
+
+        for (; drop > 0 && NULL != (shm = mpmcq_pop(&cls->pool)); --drop) 
+        {
+            stats_count(C_SEG_FREED, 1);
+            shm_free(shm);
         }
-        transferred += written;
-        sem_post(semw);
     }
-    shm_enq(shm);
-    sem_post(semw);
-    return transferred;
+}
+
+/* 
+ * Sizes that round to the same arena block are one class, their counts
+ * add up; twins would leave the second pool unfed by shm_enq and the
+ * order seg_tune keeps strict.
+ */
+int shm_add_class(size_t segsize, unsigned int num_seg) 
+{
+    shm_t*       pseg;
+    seg_class_t* cls = NULL;
+    int          idx;
+
+    if (segsize == 0 || num_seg == 0) 
+        return -1;
+
+    segsize = arena_block(segsize);
+    for (idx = 0; idx < nclasses && !cls; ++idx) 
+        if (seg_classes[idx].segsize == segsize) 
+            cls = &seg_classes[idx];
+
+    if (!cls) 
+    {
+        if (nclasses == MAX_CLASSES) 
+            return -1;
+
+        /* keep the classes sorted by size */
+        for (idx = nclasses; idx > 0 && seg_classes[idx-1].segsize > segsize;
+             --idx) 
+            seg_classes[idx] = seg_classes[idx-1];
+
+        /* the pool holds whatever shm_deq carves, seg_tune trims it */
+        cls = &seg_classes[idx];
+        cls->segsize = segsize;
+        cls->pending = 0;
+        cls->starved = 0;
+        mpmcq_init(&cls->pool, (num_seg > POOL_MAX) ? num_seg : POOL_MAX);
+        nclasses++;
+    }
+
+    /* a merged class may hold more than its pool was sized for */
+    for (unsigned int i = 0; i < num_seg; ++i) 
+        if (NULL != (pseg = shm_alloc(segsize)) && 
+            mpmcq_enqueue(&cls->pool, pseg)) 
+            shm_free(pseg);
+    return 0;
+}
+
+/* 
+ * The arena gets twice what the pools start with, the spare room is
+ * carved into extra segments when a class runs dry. Re-classing may
+ * grow a class up to SEG_AUTO, as long as eight of them fit the arena.
+ */
+int shm_pools_init(size_t* sizes, unsigned long* counts, int n) 
+{
+    size_t need = 0;
+    seg_ceiling = 0;
+    for (int i = 0; i < n; ++i) 
+    {
+        need += arena_block(sizes[i]) * counts[i];
+        if (arena_block(sizes[i]) > seg_ceiling) 
+            seg_ceiling = arena_block(sizes[i]);
+    }
+    while (seg_ceiling < SEG_AUTO && 16 * seg_ceiling <= 2 * need) 
+        seg_ceiling *= 2;
+
+    if (arena_create(2 * need)) 
+        return -1;
+    fd_chl = fd_rcv_ini();
+    mpmcq_init(&limbo, POOL_MAX);
+
+    for (int i = 0; i < n; ++i) 
+        if (shm_add_class(sizes[i], counts[i])) 
+            return -1;
+    return 0;
 }
 
 void shm_init(unsigned int num_seg, unsigned int segsize) 
 {
-    shm_t* pseg;
+    size_t        size  = segsize;
+    unsigned long count = num_seg;
+    shm_pools_init(&size, &count, 1);
+}
 
-    steque_init(&shmq);
-    for (int segnum = 0; segnum < num_seg; ++segnum) 
-        if (NULL != (pseg = create_shm(segnum, segsize))) 
-            steque_enqueue(&shmq, pseg);
+/* 
+ * spec is a comma separated list of size[:count] classes, count falls
+ * back to num_seg, e.g. "4096:64,65536:16,1048576:4"
+ */
+int shm_init_classes(const char* spec, unsigned int num_seg) 
+{
+    size_t        sizes[MAX_CLASSES];
+    unsigned long counts[MAX_CLASSES];
+    int           n    = 0;
+    int           ret  = 0;
+    char*         copy = strdup(spec);
+    char*         save = NULL;
+
+    for (char* tok = strtok_r(copy, ",", &save); tok && !ret; 
+         tok = strtok_r(NULL, ",", &save)) 
+    {
+        char* end;
+        sizes[n]  = strtoul(tok, &end, 10);
+        counts[n] = num_seg;
+        if (*end == ':') 
+            counts[n] = strtoul(end + 1, &end, 10);
+        if (*end != '\0' || sizes[n] == 0 || counts[n] == 0 || 
+            n == MAX_CLASSES) 
+            ret = -1;
+        else 
+            n++;
+    }
+    free(copy);
+
+    if (ret || n == 0) 
+        return -1;
+    return shm_pools_init(sizes, counts, n);
 }
 
-shm_t* shm_deq() 
+/* 
+ * Smallest class that fits the hint; when its pool is empty a new
+ * segment is carved from the arena before a larger class is borrowed
+ * from, and only a full arena blocks on the fitting class, for up to
+ * timeout_ms (-1 waits forever). NULL once that ran out.
+ */
+shm_t* shm_deq(size_t hint, int timeout_ms) 
 {
-    pthread_mutex_lock(&shmq_mutex);
-    while(steque_isempty(&shmq))
-        pthread_cond_wait(&shmq_cond, &shmq_mutex);
-    shm_t* shm = steque_pop(&shmq);
-    pthread_mutex_unlock(&shmq_mutex);
-    return shm;
+    shm_t* shm;
+    int    fit = 0;
+    while (fit < nclasses - 1 && seg_classes[fit].segsize < hint) 
+        fit++;
+
+    seg_class_t* cls = &seg_classes[fit];
+    if (NULL != (shm = mpmcq_pop(&cls->pool))) 
+        return shm;
+
+    __atomic_add_fetch(&cls->starved, 1, __ATOMIC_RELAXED);
+    seg_reclaim();
+    if (NULL != (shm = mpmcq_pop(&cls->pool))) 
+        return shm;
+    if (NULL != (shm = shm_alloc(cls->segsize))) 
+    {
+        stats_count(C_SEG_CARVED, 1);
+        return shm;
+    }
+
+    for (int idx = fit + 1; idx < nclasses; ++idx) 
+        if (NULL != (shm = mpmcq_pop(&seg_classes[idx].pool))) 
+        {
+            stats_count(C_SEG_BORROWED, 1);
+            return shm;
+        }
+
+    /* a re-class may leave the pool empty for good, keep carving */
+    stats_count(C_SEG_BLOCKED, 1);
+    for (int left = timeout_ms; ; ) 
+    {
+        int slice = (left >= 0 && left < SEG_WAIT_MS) ? left : SEG_WAIT_MS;
+        if (NULL != (shm = mpmcq_pop_timed(&cls->pool, slice)) ||
+            NULL != (shm = shm_alloc(cls->segsize))) 
+            return shm;
+        seg_reclaim();
+        if (left >= 0 && (left -= slice) <= 0) 
+            return NULL;
+    }
 }
 
+/* 
+ * Segments that do not fit back into their pool go back to the arena,
+ * so the caller must be through with shm, writer post included.
+ */
 void shm_enq(shm_t* shm) 
 {
-    pthread_mutex_lock(&shmq_mutex);
-    steque_enqueue(&shmq, shm);
-    pthread_mutex_unlock(&shmq_mutex);
-    pthread_cond_signal(&shmq_cond);
+    for (int idx = 0; idx < nclasses; ++idx) 
+        if (seg_classes[idx].segsize == shm->seg_size && 
+            0 == mpmcq_enqueue(&seg_classes[idx].pool, shm))
+            return;
+    shm_free(shm);
 }
 
-void cleanup() 
+/* 
+ * Gives up on the request in shm: the daemon drops it at its next wait
+ * and marks the segment done, until then it sits in limbo. Should limbo
+ * be full the segment is lost to the pools, not reused while written.
+ */
+void seg_abandon(shm_t* shm) 
 {
-    pthread_mutex_lock(&shmq_mutex);
-    while (!steque_isempty(&shmq)) 
+    stats_count(C_ABANDONED, 1);
+    cache_abandon(shm);
+    mpmcq_enqueue(&limbo, shm);
+}
+
+/* 
+ * Puts the segments the daemon is through with back in their pools. A
+ * descriptor it still sent for one is collected and closed, so the next
+ * XFER_FD request on the segment does not pick it up.
+ */
+void seg_reclaim() 
+{
+    shm_t* shm;
+    int    n = mpmcq_size(&limbo);
+
+    for (; n > 0 && NULL != (shm = mpmcq_pop(&limbo)); --n) 
     {
-        const char* shmnm = ((shm_t *)steque_pop(&shmq))->seg_name;
-        shm_unlink(shmnm);
-        sem_unlink(shmnm);
-        mq_unlink(CMD_MSG_Q);
+        cache_t* pcache = shm_getdata(shm);
+        if (__atomic_load_n(&pcache->done, __ATOMIC_ACQUIRE) != pcache->gen) 
+        {
+            mpmcq_enqueue(&limbo, shm);
+            continue;
+        }
+
+        int fd;
+        if (pcache->status == FILE_FOUND && pcache->xfer == XFER_FD && 
+            (fd = fd_recv(fd_chl, shm)) >= 0) 
+            close(fd);
+        cache_sync_init(shm);
+        shm_enq(shm);
     }
-    pthread_mutex_unlock(&shmq_mutex);
-    pthread_cond_destroy(&shmq_cond);
-    pthread_mutex_destroy(&shmq_mutex);
+}
+
+void cleanup() 
+{
+    for (int idx = 0; idx < nclasses; ++idx) 
+        mpmcq_destroy(&seg_classes[idx].pool);
+    nclasses = 0;
+    mpmcq_destroy(&limbo);
+    tune_ticks = 0;
+    memset(size_hist, 0, sizeof(size_hist));
+
+    if (fd_chl >= 0)
+        close(fd_chl);
+    fd_chl = -1;
+    arena_detach();
+    shm_unlink(SHM_ARENA);
+    for (unsigned int idx = 0; idx < nshards; ++idx) 
+        cleanup_msg(idx);
+    chash_destroy(&shards);
+    nshards = 1;
 }
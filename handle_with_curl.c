@@ -4,6 +4,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <printf.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,8 +13,12 @@
 #include <unistd.h>
 
 #include "gfserver.h"
+#include "proxy-student.h"
+#include "curl_engine.h"
+#include "hotcache.h"
 
 #define BUFSIZE (8803)
+#define FLIGHT_BUCKETS (256)
 
 /*
  * Replace with an implementation of handle_with_curl and any other
@@ -25,10 +30,148 @@ typedef struct DataChunk{
     char   *memory;
 } DataChunk;
 
-size_t writecb(void *buf, size_t size, size_t nmemb, void *arg)
+/*
+ * A client attached to a fetch. Once the fetch streams, sent counts the
+ * body bytes forwarded to ctx, or is -1 after a failed gfs_send.
+ */
+typedef struct rcpt_t{
+    gfcontext_t    *ctx;
+    ssize_t         sent;
+    struct rcpt_t  *next;
+} rcpt_t;
+
+/*
+ * Concurrent requests for the same url share one upstream fetch. The
+ * first one in performs it, the rest attach and wait. When the origin
+ * announces a Content-Length the fetch streams: the header goes out as
+ * soon as the headers are in and every chunk is forwarded to all
+ * attached clients from the write callback. Otherwise the body is
+ * buffered and each client sends it once the fetch lands. A flight
+ * leaves the table once it streams or lands, later requests fetch
+ * afresh.
+ */
+typedef struct flight_t{
+    char            *url;
+    CURL            *curl;
+    int              refcnt;
+    int              linked;
+    int              done;
+    int              streamed;
+    CURLcode         curlcode;
+    DataChunk        data;
+    rcpt_t          *rcpts;
+    pthread_cond_t   cond;
+    struct flight_t *next;
+} flight_t;
+
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static flight_t       *flights[FLIGHT_BUCKETS];
+
+static unsigned int flight_bucket(const char *url)
+{
+    unsigned int hash = 2166136261u;
+    while (*url)
+        hash = (hash ^ (unsigned char)*url++) * 16777619u;
+    return hash % FLIGHT_BUCKETS;
+}
+
+/* called with flight_mutex held */
+static void flight_unlink(flight_t *flight)
+{
+    flight_t **link = &flights[flight_bucket(flight->url)];
+
+    if (!flight->linked)
+        return;
+
+    while (*link != flight)
+        link = &(*link)->next;
+    *link = flight->next;
+    flight->linked = 0;
+}
+
+static void flight_release(flight_t *flight)
+{
+    pthread_mutex_lock(&flight_mutex);
+    int last = (--flight->refcnt == 0);
+    pthread_mutex_unlock(&flight_mutex);
+
+    if (last)
+    {
+        pthread_cond_destroy(&flight->cond);
+        free(flight->data.memory);
+        free(flight->url);
+        free(flight);
+    }
+}
+
+static void flight_land(flight_t *flight, CURLcode curlcode)
+{
+    pthread_mutex_lock(&flight_mutex);
+    flight_unlink(flight);
+    flight->curlcode = curlcode;
+    flight->done     = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+/* the recipient list is frozen from here on, no lock needed to walk it */
+static void flight_stream(flight_t *flight, curl_off_t length)
+{
+    pthread_mutex_lock(&flight_mutex);
+    flight_unlink(flight);
+    flight->streamed = 1;
+    pthread_mutex_unlock(&flight_mutex);
+
+    for (rcpt_t *rcpt = flight->rcpts; rcpt; rcpt = rcpt->next)
+        if (hot_sendheader(rcpt->ctx, GF_OK, length) < 0)
+            rcpt->sent = -1;
+}
+
+// interim 1xx blocks, errors left to FAILONERROR, unknown length
+static void flight_headers(void *arg, long code, curl_off_t length)
+{
+    if (code < 200 || code >= 400 || length < 0)
+        return;
+
+    flight_stream((flight_t *)arg, length);
+}
+
+size_t headercb(char *buf, size_t size, size_t nmemb, void *arg)
+{
+    flight_t   *flight = (flight_t *)arg;
+    size_t      total  = size * nmemb;
+    curl_off_t  length = -1;
+    long        code   = 0;
+
+    // the header block ends on an empty line
+    if (total != 2 || memcmp(buf, "\r\n", 2))
+        return total;
+
+    curl_easy_getinfo(flight->curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_getinfo(flight->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &length);
+    flight_headers(flight, code, length);
+    return total;
+}
+
+static size_t flight_data(void *arg, const void *buf, size_t total)
 {
-    DataChunk *chunk = (DataChunk *)arg;
-    size_t     total = size * nmemb;
+    flight_t  *flight = (flight_t *)arg;
+    DataChunk *chunk  = &flight->data;
+
+    if (flight->streamed)
+    {
+        for (rcpt_t *rcpt = flight->rcpts; rcpt; rcpt = rcpt->next)
+        {
+            if (rcpt->sent < 0)
+                continue;
+            if (hot_send(rcpt->ctx, buf, total) != total)
+                rcpt->sent = -1;
+            else
+                rcpt->sent += total;
+        }
+        return total;
+    }
 
     chunk->memory = realloc(chunk->memory, chunk->size + total);
     if(!chunk->memory) 
@@ -43,6 +186,11 @@ size_t writecb(void *buf, size_t size, size_t nmemb, void *arg)
     return total;
 }
 
+size_t writecb(void *buf, size_t size, size_t nmemb, void *arg)
+{
+    return flight_data(arg, buf, size * nmemb);
+}
+
 int send_data(gfcontext_t *ctx, DataChunk *data)
 {
     ssize_t transferred = 0;
@@ -54,7 +202,7 @@ int send_data(gfcontext_t *ctx, DataChunk *data)
     {
         remained = data->size - transferred;
         blk_len = (remained < BUFSIZE) ? remained : BUFSIZE;
-        sent_len = gfs_send(ctx, data->memory + transferred, blk_len);
+        sent_len = hot_send(ctx, data->memory + transferred, blk_len);
         if (sent_len != blk_len){
             fprintf(stderr, "gfs_send error");
             return EXIT_FAILURE;
@@ -64,53 +212,159 @@ int send_data(gfcontext_t *ctx, DataChunk *data)
     return 0;
 }
 
+/*
+ * Easy handles live as long as their worker so keep-alive connections
+ * survive between requests; the share object lets any worker reuse the
+ * DNS entries, TLS sessions and connections another one opened.
+ */
+static CURLSH         *share;
+static pthread_mutex_t share_mutex[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *arg)
+{
+    pthread_mutex_lock(&share_mutex[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *arg)
+{
+    pthread_mutex_unlock(&share_mutex[data]);
+}
+
+curl_worker_t* curl_workers_create(int nworkers, const char *server)
+{
+    curl_worker_t *workers;
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&share_mutex[i], NULL);
+
+    share = curl_share_init();
+    if (!share)
+        return NULL;
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    workers = calloc(nworkers, sizeof(curl_worker_t));
+    if (!workers)
+        goto fail;
+
+    for (int i = 0; i < nworkers; ++i)
+    {
+        workers[i].server = server;
+        workers[i].curl   = curl_easy_init();
+        if (!workers[i].curl)
+            goto fail;
+
+        curl_easy_setopt(workers[i].curl, CURLOPT_SHARE, share);
+        curl_easy_setopt(workers[i].curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(workers[i].curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    }
+    return workers;
+
+  fail:
+    /* calloc left the handles never made NULL */
+    for (int i = 0; workers && i < nworkers; ++i)
+        if (workers[i].curl)
+            curl_easy_cleanup(workers[i].curl);
+    free(workers);
+    curl_share_cleanup(share);
+    share = NULL;
+    return NULL;
+}
+
+static ssize_t respond(gfcontext_t *ctx, flight_t *flight, rcpt_t *rcpt)
+{
+    if (flight->streamed)
+    {
+        if (flight->curlcode || rcpt->sent < 0)
+            return EXIT_FAILURE;
+        return rcpt->sent;
+    }
+
+    if (flight->curlcode == 22) // file not found
+        return hot_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+
+    if (flight->curlcode) // other errors
+        return EXIT_FAILURE;
+
+    // success
+    hot_sendheader(ctx, GF_OK, flight->data.size);
+    if (send_data(ctx, &flight->data))
+        return EXIT_FAILURE;
+
+    return flight->data.size;
+}
+
 ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg)
 {
-    DataChunk  data;
     char       url[4096];
     CURL      *curl;
     CURLcode   curlcode;
-    int        res;
+    flight_t  *flight;
+    rcpt_t     rcpt;
+    ssize_t    res;
 
-    char      *base = arg;
-
-    memset(&data, 0, sizeof(data));
+    curl_worker_t *worker = arg;
+    char          *base   = (char *)worker->server;
 
     strcpy(url, base);
     strcat(url, path);
 
-    curl = curl_easy_init();
-    if (!curl) {
-        return EXIT_FAILURE;
-    }
+    unsigned int bucket = flight_bucket(url);
+    rcpt.ctx  = ctx;
+    rcpt.sent = 0;
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writecb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&data);
-    curlcode = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+    pthread_mutex_lock(&flight_mutex);
+    for (flight = flights[bucket]; flight; flight = flight->next)
+        if (!strcmp(flight->url, url))
+            break;
 
-    if (curlcode == 22) // file not found
+    if (flight)
     {
-        free(data.memory);
-        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-    }
+        flight->refcnt++;
+        rcpt.next     = flight->rcpts;
+        flight->rcpts = &rcpt;
+        while (!flight->done)
+            pthread_cond_wait(&flight->cond, &flight_mutex);
+        pthread_mutex_unlock(&flight_mutex);
 
-    if (curlcode) // other errors
-    {
-        free(data.memory);
-        return EXIT_FAILURE;
+        res = respond(ctx, flight, &rcpt);
+        flight_release(flight);
+        return res;
     }
 
-    // success
-    gfs_sendheader(ctx, GF_OK, data.size);
-    res = send_data(ctx, &data);
-    free(data.memory);
+    flight = calloc(1, sizeof(flight_t));
+    flight->url     = strdup(url);
+    flight->refcnt  = 1;
+    flight->linked  = 1;
+    flight->rcpts   = &rcpt;
+    flight->next    = flights[bucket];
+    flights[bucket] = flight;
+    rcpt.next       = NULL;
+    pthread_cond_init(&flight->cond, NULL);
+    pthread_mutex_unlock(&flight_mutex);
 
-    if (res)
-        return EXIT_FAILURE;
+    curl = worker->curl;
+    flight->curl = curl;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    if (engine_active())
+        curlcode = engine_perform(curl, flight_headers, flight_data, flight);
+    else
+    {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headercb);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)flight);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writecb);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)flight);
+        curlcode = curl_easy_perform(curl);
+    }
 
-    return data.size;
+    flight_land(flight, curlcode);
+    res = respond(ctx, flight, &rcpt);
+    flight_release(flight);
+    return res;
 }
-
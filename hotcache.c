@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hotcache.h"
+#include "pathidx.h"
+#include "shm_channel.h"
+
+#define HOT_SHARDS (16)
+#define HOT_SEEN   (1 << 16)
+
+typedef struct hot_obj_t
+{
+    char              path[MAX_REQUEST_LEN];
+    uint64_t          hash;
+    size_t            size;
+    uint64_t          born;         /* ms, CLOCK_MONOTONIC */
+    int               refcnt;
+    int               linked;
+    struct hot_obj_t* prev;
+    struct hot_obj_t* next;
+    char              data[];
+} hot_obj_t;
+
+/* lru is a sentinel, lru.next the most recently used object */
+typedef struct hot_shard_t
+{
+    pthread_mutex_t lock;
+    pidx_t          index;
+    size_t          bytes;
+    size_t          budget;
+    hot_obj_t       lru;
+} __attribute__((aligned(64))) hot_shard_t;
+
+/* the response this thread is recording for ctx, if any */
+typedef struct hot_capture_t
+{
+    gfcontext_t* ctx;
+    const char*  path;
+    uint64_t     hash;
+    hot_obj_t*   obj;
+    size_t       off;
+} hot_capture_t;
+
+static hot_shard_t*           shards;
+static size_t                 max_obj;
+static uint64_t               ttl;
+static uint64_t               seen[HOT_SEEN];
+static __thread hot_capture_t capture;
+
+static uint64_t hot_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* pathidx buckets on the low bits, the shard comes from the top ones */
+static hot_shard_t* hot_shard(uint64_t hash)
+{
+    return &shards[(hash >> 56) % HOT_SHARDS];
+}
+
+static void lru_unlink(hot_obj_t* obj)
+{
+    obj->prev->next = obj->next;
+    obj->next->prev = obj->prev;
+}
+
+static void lru_push(hot_shard_t* shard, hot_obj_t* obj)
+{
+    obj->prev             = &shard->lru;
+    obj->next             = shard->lru.next;
+    shard->lru.next->prev = obj;
+    shard->lru.next       = obj;
+}
+
+/* objects still being sent are unlinked now and freed by the last put */
+static void hot_evict(hot_shard_t* shard, hot_obj_t* obj)
+{
+    lru_unlink(obj);
+    pidx_remove(&shard->index, obj->hash, obj);
+    shard->bytes -= obj->size;
+    obj->linked   = 0;
+    if (obj->refcnt == 0)
+        free(obj);
+}
+
+static void hot_insert(hot_obj_t* obj)
+{
+    hot_shard_t* shard = hot_shard(obj->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    if (pidx_find(&shard->index, obj->hash, obj->path))
+    {
+        pthread_mutex_unlock(&shard->lock);
+        free(obj);
+        return;
+    }
+    while (shard->bytes + obj->size > shard->budget &&
+           shard->lru.prev != &shard->lru)
+        hot_evict(shard, shard->lru.prev);
+
+    obj->born   = hot_now();
+    obj->refcnt = 0;
+    obj->linked = 1;
+    lru_push(shard, obj);
+    pidx_insert(&shard->index, obj->hash, obj);
+    shard->bytes += obj->size;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void hot_put(hot_shard_t* shard, hot_obj_t* obj)
+{
+    pthread_mutex_lock(&shard->lock);
+    if (--obj->refcnt == 0 && !obj->linked)
+        free(obj);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+int hotcache_init(size_t budget, unsigned int ttl_secs)
+{
+    if (budget == 0 || ttl_secs == 0)
+        return 0;
+    ttl = (uint64_t)ttl_secs * 1000;
+
+    shards = aligned_alloc(sizeof(hot_shard_t), 
+                           HOT_SHARDS * sizeof(hot_shard_t));
+    if (!shards)
+        return -1;
+
+    for (int i = 0; i < HOT_SHARDS; ++i)
+    {
+        hot_shard_t* shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pidx_init(&shard->index, 256);
+        shard->bytes    = 0;
+        shard->budget   = budget / HOT_SHARDS;
+        shard->lru.prev = shard->lru.next = &shard->lru;
+    }
+    max_obj = budget / HOT_SHARDS / 4;
+    return 0;
+}
+
+ssize_t handle_with_hot(gfcontext_t *ctx, const char *path, void *arg)
+{
+    hot_worker_t* worker = arg;
+    size_t        len    = strlen(path);
+
+    if (!shards || len >= MAX_REQUEST_LEN)
+        return worker->handler(ctx, path, worker->arg);
+
+    uint64_t     hash  = path_hash(path, len);
+    hot_shard_t* shard = hot_shard(hash);
+
+    int expired = 0;
+    pthread_mutex_lock(&shard->lock);
+    hot_obj_t* obj = pidx_find(&shard->index, hash, path);
+    if (obj && hot_now() - obj->born >= ttl)
+    {
+        hot_evict(shard, obj);
+        obj     = NULL;
+        expired = 1;
+    }
+    if (obj)
+    {
+        obj->refcnt++;
+        lru_unlink(obj);
+        lru_push(shard, obj);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (obj)
+    {
+        ssize_t sent = 0;
+        size_t  size = obj->size;
+        gfs_sendheader(ctx, GF_OK, size);
+        if (size)
+            sent = gfs_send(ctx, obj->data, size);
+        hot_put(shard, obj);
+        return (sent == size) ? sent : -1;
+    }
+
+    /* one-hit wonders never make it in, a second miss or a refresh does */
+    if (__atomic_exchange_n(&seen[hash % HOT_SEEN], hash, 
+                            __ATOMIC_RELAXED) == hash || expired)
+    {
+        capture.ctx  = ctx;
+        capture.path = path;
+        capture.hash = hash;
+        capture.obj  = NULL;
+    }
+
+    ssize_t ret = worker->handler(ctx, path, worker->arg);
+
+    if (capture.ctx == ctx && capture.obj)
+    {
+        if (ret >= 0 && capture.off == capture.obj->size)
+            hot_insert(capture.obj);
+        else
+            free(capture.obj);
+    }
+    capture.ctx = NULL;
+    return ret;
+}
+
+ssize_t hot_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len)
+{
+    if (capture.ctx == ctx)
+    {
+        capture.obj = NULL;
+        if (status == GF_OK && file_len <= max_obj &&
+            NULL != (capture.obj = malloc(sizeof(hot_obj_t) + file_len)))
+        {
+            strcpy(capture.obj->path, capture.path);
+            capture.obj->hash = capture.hash;
+            capture.obj->size = file_len;
+            capture.off       = 0;
+        }
+        if (!capture.obj)
+            capture.ctx = NULL;
+    }
+    return gfs_sendheader(ctx, status, file_len);
+}
+
+ssize_t hot_send(gfcontext_t *ctx, const void *data, size_t len)
+{
+    ssize_t sent = gfs_send(ctx, data, len);
+
+    if (capture.ctx == ctx && capture.obj)
+    {
+        if (sent == len && capture.off + len <= capture.obj->size)
+        {
+            memcpy(capture.obj->data + capture.off, data, len);
+            capture.off += len;
+        }
+        else
+        {
+            free(capture.obj);
+            capture.obj = NULL;
+            capture.ctx = NULL;
+        }
+    }
+    return sent;
+}
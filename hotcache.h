@@ -0,0 +1,37 @@
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+#include <sys/types.h>
+
+#include "gfserver.h"
+
+#define HOT_TTL (1)
+
+/*
+ * In-process cache of hot objects in front of whichever handler webproxy
+ * runs. Lookups hash the path into one of HOT_SHARDS lock-striped shards,
+ * each with its own byte budget and LRU. A path is admitted on its second
+ * miss, captured while the handler sends it through hot_sendheader and
+ * hot_send. Objects older than the ttl, kept to the millisecond, are
+ * misses, so changed files show up as fast as the daemon's FD_TTL
+ * recheck lets them.
+ */
+typedef ssize_t (*hot_handler_t)(gfcontext_t *ctx, const char *path, void *arg);
+
+/* GFS_WORKER_ARG for handle_with_hot, the handler and arg it wraps */
+typedef struct hot_worker_t {
+  hot_handler_t handler;
+  void         *arg;
+} hot_worker_t;
+
+/* Splits budget bytes over the shards, a zero budget or ttl leaves it off */
+int hotcache_init(size_t budget, unsigned int ttl_secs);
+
+/* Serves hits from memory, passes misses on to the wrapped handler */
+ssize_t handle_with_hot(gfcontext_t *ctx, const char *path, void *arg);
+
+/* gfs_sendheader/gfs_send for handlers, teeing into a pending capture */
+ssize_t hot_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
+ssize_t hot_send(gfcontext_t *ctx, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "mpmcq.h"
+
+#if !defined(MPMCQ_FAILURE)
+#define MPMCQ_FAILURE (-1)
+#endif // MPMCQ_FAILURE
+
+void mpmcq_init(mpmcq_t* this, size_t capacity){
+  size_t size = 2;
+
+  while(size < capacity)
+    size <<= 1;
+
+  this->cells = malloc(size * sizeof(mpmcq_cell_t));
+  if(this->cells == NULL){
+    fprintf(stderr, "Error: out of memory in mpmcq_init.\n");
+    fflush(stderr);
+    exit(MPMCQ_FAILURE);
+  }
+
+  for(size_t i = 0; i < size; ++i)
+    this->cells[i].seq = i;
+
+  this->mask = size - 1;
+  this->head = 0;
+  this->tail = 0;
+  this->epoch = 0;
+  this->waiters = 0;
+}
+
+int mpmcq_size(mpmcq_t* this){
+  size_t tail = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+  size_t head = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+
+  return (head > tail) ? (int)(head - tail) : 0;
+}
+
+int mpmcq_isempty(mpmcq_t* this){
+  return mpmcq_size(this) == 0;
+}
+
+int mpmcq_enqueue(mpmcq_t* this, mpmcq_item item){
+  mpmcq_cell_t* cell;
+  size_t pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+
+  while(1){
+    cell = &this->cells[pos & this->mask];
+    size_t   seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->head, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return -1;
+    else
+      pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+  }
+
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  /* eventcount notify, pairs with the fence in mpmcq_pop_wait */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&this->waiters, __ATOMIC_RELAXED)){
+    __atomic_add_fetch(&this->epoch, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &this->epoch, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+  return 0;
+}
+
+mpmcq_item mpmcq_pop(mpmcq_t* this){
+  mpmcq_cell_t* cell;
+  size_t pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+
+  while(1){
+    cell = &this->cells[pos & this->mask];
+    size_t   seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return NULL;
+    else
+      pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+  }
+
+  mpmcq_item item = cell->item;
+  __atomic_store_n(&cell->seq, pos + this->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+/*
+ * Eventcount wait: take the epoch, announce ourselves, re-check the
+ * queue and only then sleep, so an enqueue in between bumps the epoch
+ * and the futex wait returns at once.
+ */
+mpmcq_item mpmcq_pop_wait(mpmcq_t* this){
+  return mpmcq_pop_timed(this, -1);
+}
+
+mpmcq_item mpmcq_pop_timed(mpmcq_t* this, int timeout_ms){
+  mpmcq_item item;
+  struct timespec now, deadline, left;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if(deadline.tv_nsec >= 1000000000L){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while((item = mpmcq_pop(this)) == NULL){
+    if(timeout_ms >= 0){
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec  = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if(left.tv_nsec < 0){
+        left.tv_sec--;
+        left.tv_nsec += 1000000000L;
+      }
+      if(left.tv_sec < 0)
+        return NULL;
+    }
+
+    uint32_t epoch = __atomic_load_n(&this->epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_add_fetch(&this->waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if((item = mpmcq_pop(this)) == NULL)
+      syscall(SYS_futex, &this->epoch, FUTEX_WAIT_PRIVATE, epoch,
+              (timeout_ms >= 0) ? &left : NULL, NULL, 0);
+    __atomic_sub_fetch(&this->waiters, 1, __ATOMIC_SEQ_CST);
+
+    if(item)
+      break;
+  }
+  return item;
+}
+
+void mpmcq_destroy(mpmcq_t* this){
+  free(this->cells);
+  this->cells = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef MPMCQ_H
+#define MPMCQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MPMCQ_LINE (64)
+
+typedef void* mpmcq_item;
+
+typedef struct mpmcq_cell_t{
+  volatile size_t seq;
+  mpmcq_item item;
+} mpmcq_cell_t;
+
+/*
+ * Bounded multi-producer/multi-consumer queue (Vyukov). Each cell's
+ * sequence number says whether it is free for the producer at position
+ * pos (seq == pos) or holds an item for the consumer (seq == pos + 1),
+ * so neither side takes a lock or allocates per item. An eventcount
+ * lets consumers block in mpmcq_pop_wait without a mutex.
+ */
+typedef struct{
+  volatile size_t   head    __attribute__((aligned(MPMCQ_LINE)));
+  volatile size_t   tail    __attribute__((aligned(MPMCQ_LINE)));
+  volatile uint32_t epoch   __attribute__((aligned(MPMCQ_LINE)));
+  volatile uint32_t waiters;
+  mpmcq_cell_t*     cells   __attribute__((aligned(MPMCQ_LINE)));
+  size_t            mask;
+}mpmcq_t;
+
+
+/* Initializes the queue, capacity is rounded up to a power of two */
+void mpmcq_init(mpmcq_t* this, size_t capacity);
+
+/* Return 1 if empty, 0 otherwise */
+int mpmcq_isempty(mpmcq_t* this);
+
+/* Returns the number of elements in the queue */
+int mpmcq_size(mpmcq_t* this);
+
+/* Adds an element to the "back" of the queue, -1 when it is full */
+int mpmcq_enqueue(mpmcq_t* this, mpmcq_item item);
+
+/* Removes the element at the "front" of the queue, NULL when empty */
+mpmcq_item mpmcq_pop(mpmcq_t* this);
+
+/* Like mpmcq_pop but sleeps until an element shows up */
+mpmcq_item mpmcq_pop_wait(mpmcq_t* this);
+
+/* Like mpmcq_pop_wait but gives up with NULL after timeout_ms, -1 waits on */
+mpmcq_item mpmcq_pop_timed(mpmcq_t* this, int timeout_ms);
+
+/* Frees the cells, the queue must no longer be in use */
+void mpmcq_destroy(mpmcq_t* this);
+
+#endif
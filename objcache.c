@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "objcache.h"
+#include "pathidx.h"
+
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+static pthread_mutex_t obj_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char*     arena;
+static size_t    arena_size;
+static uint32_t* free_blocks;
+static uint32_t  nfree;
+static uint32_t  nblocks;
+static pidx_t    obj_index;
+static uint32_t  nresident;
+static obj_t*    hand;
+
+/* new objects go right behind the hand, i.e. last in the sweep */
+static void clock_insert(obj_t* obj)
+{
+    if (!hand)
+    {
+        obj->prev = obj->next = obj;
+        hand = obj;
+        return;
+    }
+    obj->next        = hand;
+    obj->prev        = hand->prev;
+    hand->prev->next = obj;
+    hand->prev       = obj;
+}
+
+static void clock_remove(obj_t* obj)
+{
+    if (obj->next == obj)
+    {
+        hand = NULL;
+        return;
+    }
+    obj->prev->next = obj->next;
+    obj->next->prev = obj->prev;
+    if (hand == obj)
+        hand = obj->next;
+}
+
+static void obj_free(obj_t* obj)
+{
+    for (unsigned int i = 0; i < obj->nblocks; ++i)
+        free_blocks[nfree++] = obj->blocks[i];
+    free(obj);
+}
+
+/*
+ * Sweeps the CLOCK hand until need blocks are free. Referenced objects
+ * get a second chance, objects still being served are skipped.
+ */
+static int evict(uint32_t need)
+{
+    uint32_t steps = 2 * nresident + 1;
+
+    while (nfree < need && hand && steps--)
+    {
+        obj_t* victim = hand;
+        hand = hand->next;
+
+        if (victim->referenced)
+        {
+            victim->referenced = 0;
+            continue;
+        }
+        if (victim->refcnt)
+            continue;
+
+        clock_remove(victim);
+        pidx_remove(&obj_index, victim->hash, victim);
+        nresident--;
+        obj_free(victim);
+    }
+    return (nfree >= need) ? 0 : -1;
+}
+
+int objcache_init(size_t budget)
+{
+    if (budget == 0)
+        return 0;
+
+    arena_size = (budget + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    arena = mmap(NULL, arena_size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (arena == MAP_FAILED)
+    {
+        arena = mmap(NULL, arena_size, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED)
+        {
+            arena = NULL;
+            return -1;
+        }
+        madvise(arena, arena_size, MADV_HUGEPAGE);
+    }
+
+    nblocks     = arena_size / OBJ_BLOCK;
+    free_blocks = malloc(nblocks * sizeof(uint32_t));
+    for (nfree = 0; nfree < nblocks; ++nfree)
+        free_blocks[nfree] = nblocks - 1 - nfree;
+
+    pidx_init(&obj_index, nblocks);
+    return 0;
+}
+
+obj_t* objcache_get(const char* path, uint64_t hash)
+{
+    if (!arena)
+        return NULL;
+
+    pthread_mutex_lock(&obj_mutex);
+    obj_t* obj = pidx_find(&obj_index, hash, path);
+    if (obj)
+    {
+        obj->refcnt++;
+        obj->referenced = 1;
+    }
+    pthread_mutex_unlock(&obj_mutex);
+    return obj;
+}
+
+obj_t* objcache_fill(const char* path, uint64_t hash, size_t size)
+{
+    obj_t*   obj  = NULL;
+    uint32_t need = (size + OBJ_BLOCK - 1) / OBJ_BLOCK;
+
+    if (!arena || size > arena_size / 4 || strlen(path) >= OBJ_PATHLEN)
+        return NULL;
+
+    pthread_mutex_lock(&obj_mutex);
+    if (pidx_find(&obj_index, hash, path) || evict(need))
+        goto done;
+
+    obj = malloc(sizeof(obj_t) + need * sizeof(uint32_t));
+    if (!obj)
+        goto done;
+
+    strcpy(obj->path, path);
+    obj->hash       = hash;
+    obj->size       = size;
+    obj->nblocks    = need;
+    obj->refcnt     = 1;
+    obj->referenced = 0;
+    obj->complete   = 0;
+    for (unsigned int i = 0; i < need; ++i)
+        obj->blocks[i] = free_blocks[--nfree];
+
+  done:
+    pthread_mutex_unlock(&obj_mutex);
+    return obj;
+}
+
+/* the filler's reference goes away with the commit */
+void objcache_commit(obj_t* obj)
+{
+    pthread_mutex_lock(&obj_mutex);
+    if (pidx_find(&obj_index, obj->hash, obj->path))
+    {
+        obj_free(obj);
+    }
+    else
+    {
+        obj->refcnt   = 0;
+        obj->complete = 1;
+        pidx_insert(&obj_index, obj->hash, obj);
+        clock_insert(obj);
+        nresident++;
+    }
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+void objcache_abort(obj_t* obj)
+{
+    pthread_mutex_lock(&obj_mutex);
+    obj_free(obj);
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+size_t objcache_read(obj_t* obj, size_t off, void* dst, size_t len)
+{
+    if (off >= obj->size)
+        return 0;
+    if (len > obj->size - off)
+        len = obj->size - off;
+
+    for (size_t done = 0; done < len; )
+    {
+        size_t pos  = off + done;
+        size_t boff = pos % OBJ_BLOCK;
+        size_t n    = OBJ_BLOCK - boff;
+        if (n > len - done)
+            n = len - done;
+        memcpy((char*)dst + done,
+               arena + (size_t)obj->blocks[pos / OBJ_BLOCK] * OBJ_BLOCK +
+               boff, n);
+        done += n;
+    }
+    return len;
+}
+
+size_t objcache_write(obj_t* obj, size_t off, const void* src, size_t len)
+{
+    if (off >= obj->size)
+        return 0;
+    if (len > obj->size - off)
+        len = obj->size - off;
+
+    for (size_t done = 0; done < len; )
+    {
+        size_t pos  = off + done;
+        size_t boff = pos % OBJ_BLOCK;
+        size_t n    = OBJ_BLOCK - boff;
+        if (n > len - done)
+            n = len - done;
+        memcpy(arena + (size_t)obj->blocks[pos / OBJ_BLOCK] * OBJ_BLOCK +
+               boff, (const char*)src + done, n);
+        done += n;
+    }
+    return len;
+}
+
+/* dropped objects are no longer complete and go with the last reader */
+void objcache_put(obj_t* obj)
+{
+    pthread_mutex_lock(&obj_mutex);
+    if (--obj->refcnt == 0 && !obj->complete)
+        obj_free(obj);
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+void objcache_drop(const char* path, uint64_t hash)
+{
+    if (!arena)
+        return;
+
+    pthread_mutex_lock(&obj_mutex);
+    obj_t* obj = pidx_find(&obj_index, hash, path);
+    if (obj)
+    {
+        clock_remove(obj);
+        pidx_remove(&obj_index, hash, obj);
+        nresident--;
+        obj->complete = 0;
+        if (obj->refcnt == 0)
+            obj_free(obj);
+    }
+    pthread_mutex_unlock(&obj_mutex);
+}
+
+void objcache_destroy()
+{
+    if (!arena)
+        return;
+
+    pthread_mutex_lock(&obj_mutex);
+    while (hand)
+    {
+        obj_t* obj = hand;
+        clock_remove(obj);
+        free(obj);
+    }
+    pidx_destroy(&obj_index);
+    free(free_blocks);
+    munmap(arena, arena_size);
+    arena = NULL;
+    pthread_mutex_unlock(&obj_mutex);
+}
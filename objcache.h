@@ -0,0 +1,54 @@
+#ifndef OBJCACHE_H
+#define OBJCACHE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define OBJ_BLOCK   (64 * 1024)
+#define OBJ_PATHLEN (128)
+
+/*
+ * Resident object cache for simplecached. File contents live in fixed
+ * size blocks of one (hugepage backed where possible) arena and are
+ * evicted with CLOCK once the byte budget is used up.
+ */
+typedef struct obj_t
+{
+  char           path[OBJ_PATHLEN];
+  size_t         size;
+  unsigned int   nblocks;
+  int            refcnt;
+  int            referenced;
+  int            complete;
+  uint64_t       hash;
+  struct obj_t*  prev;
+  struct obj_t*  next;
+  uint32_t       blocks[];
+} obj_t;
+
+/* Sets up the arena, a zero budget leaves the cache disabled */
+int objcache_init(size_t budget);
+
+/* Returns a referenced, fully filled object or NULL on a miss */
+obj_t* objcache_get(const char* path, uint64_t hash);
+
+/* Reserves room for a new object of size bytes, NULL when not admitted */
+obj_t* objcache_fill(const char* path, uint64_t hash, size_t size);
+
+/* Publishes a filled object, or drops it when the fill failed */
+void objcache_commit(obj_t* obj);
+void objcache_abort(obj_t* obj);
+
+/* Copies between the object's blocks and a flat buffer */
+size_t objcache_read(obj_t* obj, size_t off, void* dst, size_t len);
+size_t objcache_write(obj_t* obj, size_t off, const void* src, size_t len);
+
+/* Drops a reference taken by objcache_get */
+void objcache_put(obj_t* obj);
+
+/* Forgets path's object, readers still holding it finish undisturbed */
+void objcache_drop(const char* path, uint64_t hash);
+
+void objcache_destroy();
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathidx.h"
+
+#define PIDX_EMPTY (0)
+#define PIDX_TOMB  (1)
+
+/* 0 and 1 mark free slots, real hashes are moved out of their way */
+static uint64_t pidx_key(uint64_t hash)
+{
+    return (hash > PIDX_TOMB) ? hash : hash + 2;
+}
+
+static pidx_bkt_t* pidx_alloc(size_t nbkts)
+{
+    pidx_bkt_t* bkts = aligned_alloc(sizeof(pidx_bkt_t),
+                                     nbkts * sizeof(pidx_bkt_t));
+    memset(bkts, 0, nbkts * sizeof(pidx_bkt_t));
+    return bkts;
+}
+
+static void pidx_place(pidx_t* idx, uint64_t key, void* val)
+{
+    for (size_t b = key & idx->mask; ; b = (b + 1) & idx->mask)
+        for (int w = 0; w < PIDX_WAYS; ++w)
+            if (idx->bkts[b].hash[w] <= PIDX_TOMB)
+            {
+                if (idx->bkts[b].hash[w] == PIDX_EMPTY)
+                    idx->used++;
+                idx->bkts[b].hash[w] = key;
+                idx->bkts[b].val[w]  = val;
+                idx->live++;
+                return;
+            }
+}
+
+/* doubles when live entries fill it, rebuilds in place of tombstones */
+static void pidx_grow(pidx_t* idx)
+{
+    pidx_bkt_t* old   = idx->bkts;
+    size_t      nbkts = idx->mask + 1;
+    size_t      size  = nbkts;
+
+    if (4 * idx->live >= 2 * nbkts * PIDX_WAYS)
+        size *= 2;
+
+    idx->bkts = pidx_alloc(size);
+    idx->mask = size - 1;
+    idx->live = idx->used = 0;
+    for (size_t b = 0; b < nbkts; ++b)
+        for (int w = 0; w < PIDX_WAYS; ++w)
+            if (old[b].hash[w] > PIDX_TOMB)
+                pidx_place(idx, old[b].hash[w], old[b].val[w]);
+    free(old);
+}
+
+void pidx_init(pidx_t* idx, size_t capacity)
+{
+    size_t nbkts = 1;
+    while (3 * nbkts * PIDX_WAYS < 4 * capacity)
+        nbkts *= 2;
+
+    idx->bkts = pidx_alloc(nbkts);
+    idx->mask = nbkts - 1;
+    idx->live = idx->used = 0;
+}
+
+void* pidx_find(pidx_t* idx, uint64_t hash, const char* path)
+{
+    uint64_t key = pidx_key(hash);
+
+    for (size_t b = key & idx->mask, n = 0; n <= idx->mask; 
+         b = (b + 1) & idx->mask, ++n)
+    {
+        pidx_bkt_t* bkt = &idx->bkts[b];
+        for (int w = 0; w < PIDX_WAYS; ++w)
+        {
+            if (bkt->hash[w] == key && 0 == strcmp(bkt->val[w], path))
+                return bkt->val[w];
+            if (bkt->hash[w] == PIDX_EMPTY)
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+void pidx_insert(pidx_t* idx, uint64_t hash, void* val)
+{
+    if (4 * (idx->used + 1) > 3 * (idx->mask + 1) * PIDX_WAYS)
+        pidx_grow(idx);
+    pidx_place(idx, pidx_key(hash), val);
+}
+
+void pidx_remove(pidx_t* idx, uint64_t hash, void* val)
+{
+    uint64_t key = pidx_key(hash);
+
+    for (size_t b = key & idx->mask, n = 0; n <= idx->mask; 
+         b = (b + 1) & idx->mask, ++n)
+    {
+        pidx_bkt_t* bkt = &idx->bkts[b];
+        for (int w = 0; w < PIDX_WAYS; ++w)
+        {
+            if (bkt->hash[w] == key && bkt->val[w] == val)
+            {
+                bkt->hash[w] = PIDX_TOMB;
+                bkt->val[w]  = NULL;
+                idx->live--;
+                return;
+            }
+            if (bkt->hash[w] == PIDX_EMPTY)
+                return;
+        }
+    }
+}
+
+void* pidx_next(pidx_t* idx, size_t* pos)
+{
+    size_t slots = (idx->mask + 1) * PIDX_WAYS;
+    for (; *pos < slots; ++*pos)
+    {
+        pidx_bkt_t* bkt = &idx->bkts[*pos / PIDX_WAYS];
+        if (bkt->hash[*pos % PIDX_WAYS] > PIDX_TOMB)
+            return bkt->val[(*pos)++ % PIDX_WAYS];
+    }
+    return NULL;
+}
+
+void pidx_destroy(pidx_t* idx)
+{
+    free(idx->bkts);
+    idx->bkts = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef PATHIDX_H
+#define PATHIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIDX_WAYS (4)
+
+/*
+ * Open addressing index keyed by the 64-bit path hash the proxy sends
+ * along with each request. A bucket is one cache line holding the
+ * hashes and values of PIDX_WAYS entries, probed linearly; the stored
+ * path is only compared when a hash matches. Values must start with
+ * their NUL terminated path (obj_t, fdent_t). Not thread safe, callers
+ * hold their own lock.
+ */
+typedef struct pidx_bkt_t
+{
+  uint64_t hash[PIDX_WAYS];
+  void*    val[PIDX_WAYS];
+} __attribute__((aligned(64))) pidx_bkt_t;
+
+typedef struct pidx_t
+{
+  pidx_bkt_t* bkts;
+  size_t      mask;
+  size_t      live;
+  size_t      used;             /* live entries plus tombstones */
+} pidx_t;
+
+/* Sizes the table for capacity entries, it grows past that */
+void pidx_init(pidx_t* idx, size_t capacity);
+
+/* Returns the value for path, NULL when it is not indexed */
+void* pidx_find(pidx_t* idx, uint64_t hash, const char* path);
+
+void pidx_insert(pidx_t* idx, uint64_t hash, void* val);
+void pidx_remove(pidx_t* idx, uint64_t hash, void* val);
+
+/* Walks every value, start with *pos = 0, NULL at the end */
+void* pidx_next(pidx_t* idx, size_t* pos);
+
+void pidx_destroy(pidx_t* idx);
+
+#endif
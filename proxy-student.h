@@ -3,5 +3,35 @@
  */
  #ifndef __SERVER_STUDENT_H__
  #define __SERVER_STUDENT_H__
+
+ #include <curl/curl.h>
+
+ /* Per gfserver worker state for handle_with_curl, passed as GFS_WORKER_ARG */
+ typedef struct curl_worker_t {
+   const char *server;
+   CURL       *curl;
+ } curl_worker_t;
+
+ /* One easy handle per worker, all attached to a shared DNS/TLS/connection cache */
+ curl_worker_t* curl_workers_create(int nworkers, const char *server);
+
+ /* Segment pools for handle_with_cache, spec is "size[:count],..." */
+ void shm_init(unsigned int num_seg, unsigned int segsize);
+ int shm_init_classes(const char *spec, unsigned int num_seg);
+ void cleanup();
+
+ /* GFS_WORKER_ARG for handle_with_cache. A request the cache cannot take in
+  * time goes to fallback, or fails fast with GF_ERROR when there is none */
+ typedef struct cache_worker_t {
+   struct cmd_chl_t **chl;      /* one per simplecached instance */
+   ssize_t         (*fallback)(struct gfcontext_t *ctx, const char *path, void *arg);
+   void             *fallback_arg;
+ } cache_worker_t;
+
+ /* Deadlines for handle_with_cache in ms: a free segment, each daemon reply */
+ void cache_timeouts(int seg_wait_ms, int reply_wait_ms);
+
+ /* Spreads paths over ncaches simplecached instances, started with -n 0.. */
+ int cache_shards(unsigned int ncaches);
  
  #endif // __SERVER_STUDENT_H__
\ No newline at end of file
@@ -1,13 +1,40 @@
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "shm_channel.h"
 
+#define SHM_SPIN (1024)
+
+/* spinning only pays when the other side runs on another CPU */
+static int shm_spin = -1;
+
+static int spin_limit() 
+{
+    if (shm_spin < 0) 
+        shm_spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+    return shm_spin;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 void* shm_getdata(shm_t *shm) 
 {
     return ((void*)shm + sizeof(shm_t));
@@ -17,6 +44,7 @@ void* cache_init(shm_t* shm)
 {
     cache_t* cache_data    = shm_getdata(shm);
     cache_data->status     = FILE_NOT_FOUND;
+    cache_data->xfer       = XFER_CHUNK;
     cache_data->file_size  = 0;
     cache_data->cache_size = shm->seg_size - sizeof(shm_t) - 
                              sizeof(cache_t);
@@ -28,167 +56,842 @@ void* cache_get_data(cache_t *cache)
     return ((void*)cache + sizeof(cache_t));
 }
 
-shm_t* create_shm(unsigned int segnum, unsigned int segsz) 
+ring_t* ring_get(cache_t *cache) 
 {
-    int    shmfd;
-    char   segName[NAME_LEN] = {0};
-    shm_t* pseg              = NULL;
+    uintptr_t data = (uintptr_t)cache_get_data(cache);
+    return (ring_t*)((data + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+}
 
-    snprintf(segName, NAME_LEN, "/data_shm_%d", segnum);
-    shmfd = shm_open(segName, O_CREAT|O_RDWR, S_IRWXU|S_IRWXG);
-    if (shmfd < 0) 
-        goto done;
+static slot_t* ring_slot(ring_t *ring, uint32_t idx) 
+{
+    size_t stride = sizeof(slot_t) + ring->slot_size;
+    return (slot_t*)((char*)ring + sizeof(ring_t) +
+                     (idx & (ring->nslots - 1)) * stride);
+}
+
+/* 
+ * Carves the data area into nslots (a power of two) slots, halving the
+ * count until each slot holds at least RING_MIN_SLOT bytes. Returns NULL
+ * when the segment is too small for two slots.
+ */
+ring_t* ring_init(cache_t *cache, unsigned int nslots) 
+{
+    ring_t* ring  = ring_get(cache);
+    size_t  used  = (char*)ring - (char*)cache_get_data(cache) + 
+                    sizeof(ring_t);
+    if (cache->cache_size <= used) 
+        return NULL;
+
+    size_t avail = cache->cache_size - used;
+    for (; nslots >= 2; nslots >>= 1) 
+    {
+        size_t stride = (avail / nslots) & ~(size_t)(CACHE_LINE - 1);
+        if (stride < sizeof(slot_t) + RING_MIN_SLOT) 
+            continue;
+
+        ring->head         = 0;
+        ring->head_waiters = 0;
+        ring->tail         = 0;
+        ring->tail_waiters = 0;
+        ring->nslots       = nslots;
+        ring->slot_size    = stride - sizeof(slot_t);
+        return ring;
+    }
+    return NULL;
+}
 
-    ftruncate(shmfd, sizeof(shm_t) + segsz);
+static long futex(volatile uint32_t *word, int op, uint32_t val,
+                  const struct timespec *ts) 
+{
+    return syscall(SYS_futex, word, op, val, ts, NULL, 0);
+}
 
-    pseg = mmap(0, sizeof(shm_t) + segsz, (PROT_READ|PROT_WRITE),
-                MAP_SHARED, shmfd, 0);
-    close(shmfd);
-    if (pseg == MAP_FAILED) 
+/* 
+ * Spins, then sleeps on the futex, until *word moves away from val.
+ * Segments are shared between processes so no FUTEX_PRIVATE_FLAG.
+ */
+static int wait_change(volatile uint32_t *word, uint32_t val,
+                       volatile uint32_t *waiters, int timeout) 
+{
+    struct timespec deadline, now, rel;
+    int             ret   = 0;
+    int             limit = spin_limit();
+
+    for (int spin = 0; spin < limit; ++spin) 
     {
-        pseg = NULL;
-        goto done;
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != val) 
+            return 0;
+        cpu_relax();
     }
 
-    strncpy(pseg->seg_name, segName, NAME_LEN-1);
-    pseg->seg_name[NAME_LEN-1] = '\0';
-    pseg->seg_size = segsz;
+    if (timeout != SHM_FOREVER) 
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) 
+        {
+            deadline.tv_sec  += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
 
-  done:
-    return pseg;
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == val) 
+    {
+        struct timespec* pts = NULL;
+        if (timeout != SHM_FOREVER) 
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec  = deadline.tv_sec - now.tv_sec;
+            rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0) 
+            {
+                rel.tv_sec  -= 1;
+                rel.tv_nsec += 1000000000L;
+            }
+            if (rel.tv_sec < 0) 
+            {
+                ret = -1;
+                break;
+            }
+            pts = &rel;
+        }
+        futex(word, FUTEX_WAIT, val, pts);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
+
+/* callers publish *word with a seq_cst store before calling this */
+static void wake(volatile uint32_t *word, volatile uint32_t *waiters) 
+{
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        futex(word, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* 
+ * gen and done are left alone, a daemon worker may still store a late
+ * done; only shm_alloc starts a segment over at generation 0.
+ */
+void cache_sync_init(shm_t* shm) 
+{
+    cache_t* cache = shm_getdata(shm);
+
+    cache->reader.seq     = 0;
+    cache->reader.waiters = 0;
+    cache->reader.taken   = 0;
+    cache->writer.seq     = 1;
+    cache->writer.waiters = 0;
+    cache->writer.taken   = 0;
+    cache->abandoned      = 0;
+}
+
+/* 
+ * The daemon's last touch of a request's segment. done only moves
+ * forward: the proxy may reuse the segment before this store lands, and
+ * a late store must neither match nor hide a later generation.
+ */
+void cache_done(cache_t* cache, uint32_t gen) 
+{
+    uint32_t done = __atomic_load_n(&cache->done, __ATOMIC_RELAXED);
+
+    while ((int32_t)(gen - done) > 0 && 
+           !__atomic_compare_exchange_n(&cache->done, &done, gen, 1, 
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/* 
+ * Makes the daemon drop the request in flight on shm at its next wait
+ * and wakes it if it already sleeps on the writer or on a full ring,
+ * whose every slot now counts as drained. A ring_init racing with this
+ * may eat the wake, the daemon then gives up after its own SHM_TIMEOUT.
+ * The segment is the daemon's until done catches up with gen.
+ */
+void cache_abandon(shm_t* shm) 
+{
+    cache_t* cache = shm_getdata(shm);
+    ring_t*  ring  = ring_get(cache);
+
+    __atomic_store_n(&cache->abandoned, 1, __ATOMIC_SEQ_CST);
+    shm_post(&cache->writer);
+
+    if ((char*)(ring + 1) <= (char*)shm + shm->seg_size) 
+    {
+        __atomic_store_n(&ring->tail, ring->head, __ATOMIC_SEQ_CST);
+        wake(&ring->tail, &ring->tail_waiters);
+    }
+}
+
+int shm_wait(shm_sync_t *sync, int timeout) 
+{
+    uint32_t taken = sync->taken;
+
+    if (__atomic_load_n(&sync->seq, __ATOMIC_ACQUIRE) == taken &&
+        wait_change(&sync->seq, taken, &sync->waiters, timeout))
+        return -1;
+
+    sync->taken = taken + 1;
+    return 0;
+}
+
+void shm_post(shm_sync_t *sync) 
+{
+    __atomic_add_fetch(&sync->seq, 1, __ATOMIC_SEQ_CST);
+    wake(&sync->seq, &sync->waiters);
+}
+
+void* ring_produce(ring_t *ring, int timeout) 
+{
+    return ring_reserve(ring, 0, timeout);
+}
+
+/* a zero timeout only looks, it never spins or sleeps */
+void* ring_reserve(ring_t *ring, uint32_t ahead, int timeout) 
+{
+    uint32_t head = ring->head + ahead;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    while (head - tail >= ring->nslots) 
+    {
+        if (timeout == 0 || 
+            wait_change(&ring->tail, tail, &ring->tail_waiters, timeout)) 
+            return NULL;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    return ring_slot(ring, head) + 1;
+}
+
+void ring_publish(ring_t *ring, size_t len) 
+{
+    uint32_t head = ring->head;
+
+    ring_slot(ring, head)->len = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake(&ring->head, &ring->head_waiters);
+}
+
+void* ring_consume(ring_t *ring, size_t *len, int timeout) 
+{
+    uint32_t tail = ring->tail;
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail &&
+        wait_change(&ring->head, tail, &ring->head_waiters, timeout))
+        return NULL;
+
+    slot_t* slot = ring_slot(ring, tail);
+    *len = slot->len;
+    return slot + 1;
+}
+
+void ring_release(ring_t *ring) 
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    wake(&ring->tail, &ring->tail_waiters);
+}
+
+/* 
+ * One POSIX shm object holds every segment. The proxy carves blocks out
+ * of it with a buddy allocator whose state sits in the arena's first
+ * block; the daemon maps it once and only ever sees offsets.
+ */
+#define ARENA_EMPTY ((size_t)-1)
+#define HUGE_PAGE   (2 * 1024 * 1024)
+
+typedef struct arena_t 
+{
+    size_t       size;
+    unsigned int orders;
+    size_t       free_list[ARENA_ORDERS];
+    uint8_t      map[];     /* per min block, order + 1 of a free head */
+} arena_t;
+
+typedef struct arena_free_t 
+{
+    size_t next;
+    size_t prev;
+} arena_free_t;
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static char*           arena_base;
+static size_t          arena_size;
+
+static arena_free_t* arena_node(size_t off) 
+{
+    return (arena_free_t*)(arena_base + off);
+}
+
+static void arena_push(arena_t* arena, unsigned int order, size_t off) 
+{
+    arena_free_t* node = arena_node(off);
+    node->next = arena->free_list[order];
+    node->prev = ARENA_EMPTY;
+    if (node->next != ARENA_EMPTY) 
+        arena_node(node->next)->prev = off;
+    arena->free_list[order] = off;
+    arena->map[off / ARENA_MIN_BLOCK] = order + 1;
+}
+
+static void arena_unlink(arena_t* arena, unsigned int order, size_t off) 
+{
+    arena_free_t* node = arena_node(off);
+    if (node->prev != ARENA_EMPTY) 
+        arena_node(node->prev)->next = node->next;
+    else 
+        arena->free_list[order] = node->next;
+    if (node->next != ARENA_EMPTY) 
+        arena_node(node->next)->prev = node->prev;
+    arena->map[off / ARENA_MIN_BLOCK] = 0;
+}
+
+static unsigned int arena_order(size_t size) 
+{
+    unsigned int order = 0;
+    while (((size_t)ARENA_MIN_BLOCK << order) < size) 
+        order++;
+    return order;
+}
+
+/* splits keep the lower half and put the upper one on the free list */
+static size_t arena_alloc(arena_t* arena, unsigned int order) 
+{
+    unsigned int found = order;
+    while (found < arena->orders && arena->free_list[found] == ARENA_EMPTY) 
+        found++;
+    if (found >= arena->orders) 
+        return ARENA_EMPTY;
+
+    size_t off = arena->free_list[found];
+    arena_unlink(arena, found, off);
+    while (found > order) 
+    {
+        found--;
+        arena_push(arena, found, off + ((size_t)ARENA_MIN_BLOCK << found));
+    }
+    return off;
+}
+
+static void arena_release(arena_t* arena, unsigned int order, size_t off) 
+{
+    while (order + 1 < arena->orders) 
+    {
+        size_t buddy = off ^ ((size_t)ARENA_MIN_BLOCK << order);
+        if (arena->map[buddy / ARENA_MIN_BLOCK] != order + 1) 
+            break;
+        arena_unlink(arena, order, buddy);
+        if (buddy < off) 
+            off = buddy;
+        order++;
+    }
+    arena_push(arena, order, off);
+}
+
+size_t arena_block(size_t segsz) 
+{
+    return (size_t)ARENA_MIN_BLOCK << arena_order(segsz);
 }
 
-shm_t* get_shmseg(const char* shmnm, size_t shmsz) 
+static void* arena_map(int oflag, size_t size) 
 {
-    shm_t *pseg = NULL;
-    
-    int   shmfd = shm_open(shmnm, O_RDWR, S_IRWXU|S_IRWXG);
+    void* base = NULL;
+    int   shmfd = shm_open(SHM_ARENA, oflag, S_IRWXU|S_IRWXG);
     if (shmfd < 0) 
         goto done;
 
-    ftruncate(shmfd, sizeof(shm_t) + shmsz);
+    if ((oflag & O_CREAT) && ftruncate(shmfd, size) < 0) 
+    {
+        close(shmfd);
+        goto done;
+    }
 
-    pseg = mmap(0, sizeof(shm_t) + shmsz, PROT_READ|PROT_WRITE,
-                MAP_SHARED, shmfd, 0);
+    base = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, shmfd, 0);
     close(shmfd);
-    if (pseg == MAP_FAILED) 
+    if (base == MAP_FAILED) 
     {
-        pseg = NULL;
+        base = NULL;
         goto done;
     }
-
-    strncpy(pseg->seg_name, shmnm, NAME_LEN-1);
-    pseg->seg_name[NAME_LEN-1] = '\0';
-    pseg->seg_size = shmsz;
+    /* tmpfs backs this with huge pages when shmem_enabled allows it */
+    madvise(base, size, MADV_HUGEPAGE);
 
   done:
+    return base;
+}
+
+/* size is rounded up to a power of two of at least one huge page */
+int arena_create(size_t size) 
+{
+    size_t       total  = HUGE_PAGE;
+    unsigned int orders = arena_order(HUGE_PAGE) + 1;
+    while (total < size && orders < ARENA_ORDERS) 
+    {
+        total <<= 1;
+        orders++;
+    }
+
+    shm_unlink(SHM_ARENA);
+    if (NULL == (arena_base = arena_map(O_CREAT|O_RDWR, total))) 
+        return -1;
+    arena_size = total;
+
+    /* the header takes the first block and is never released, the rest
+     * is what splitting the whole arena down to it would leave free */
+    arena_t*     arena = (arena_t*)arena_base;
+    unsigned int hdr   = arena_order(sizeof(arena_t) + total / ARENA_MIN_BLOCK);
+    arena->size   = total;
+    arena->orders = orders;
+    memset(arena->map, 0, total / ARENA_MIN_BLOCK);
+    for (unsigned int i = 0; i < ARENA_ORDERS; ++i) 
+        arena->free_list[i] = ARENA_EMPTY;
+    for (unsigned int i = hdr; i + 1 < orders; ++i) 
+        arena_push(arena, i, (size_t)ARENA_MIN_BLOCK << i);
+    return 0;
+}
+
+int arena_attach(size_t size) 
+{
+    if (NULL == (arena_base = arena_map(O_RDWR, size))) 
+        return -1;
+    arena_size = size;
+    return 0;
+}
+
+void arena_detach() 
+{
+    if (arena_base) 
+        munmap(arena_base, arena_size);
+    arena_base = NULL;
+    arena_size = 0;
+}
+
+static size_t arena_carve(unsigned int order) 
+{
+    pthread_mutex_lock(&arena_lock);
+    size_t off = arena_base ? arena_alloc((arena_t*)arena_base, order) : 
+                              ARENA_EMPTY;
+    pthread_mutex_unlock(&arena_lock);
+    return off;
+}
+
+shm_t* shm_alloc(size_t segsz) 
+{
+    unsigned int order = arena_order(segsz);
+    size_t       off   = arena_carve(order);
+    if (off == ARENA_EMPTY) 
+        return NULL;
+
+    shm_t* pseg    = (shm_t*)(arena_base + off);
+    pseg->seg_off  = off;
+    pseg->seg_size = (size_t)ARENA_MIN_BLOCK << order;
+    pseg->xfd      = -1;
+    cache_sync_init(pseg);
+
+    cache_t* cache = shm_getdata(pseg);
+    cache->gen  = 0;
+    cache->done = 0;
     return pseg;
 }
 
-mqd_t cmd_snd_ini() 
+void shm_free(shm_t* shm) 
 {
-    struct mq_attr attr;
-    req_t          req;
+    if (shm->xfd >= 0) 
+        close(shm->xfd);
 
-    attr.mq_msgsize = sizeof(req_t);
-    attr.mq_maxmsg  = 8;
-    attr.mq_curmsgs = 0;
-    attr.mq_flags   = 0;
+    pthread_mutex_lock(&arena_lock);
+    arena_release((arena_t*)arena_base, arena_order(shm->seg_size), 
+                  shm->seg_off);
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/* daemon side, only checks that the segment lies inside the arena */
+shm_t* shmseg_lookup(size_t shmoff, size_t shmsz) 
+{
+    if (!arena_base || shmoff == 0 || shmoff % ARENA_MIN_BLOCK || 
+        shmsz < sizeof(shm_t) + sizeof(cache_t) || 
+        shmoff >= arena_size || shmsz > arena_size - shmoff) 
+        return NULL;
+    return (shm_t*)(arena_base + shmoff);
+}
+
+/* 
+ * A single abstract unix socket, "\0/data_shm_arena_fd". The daemon
+ * hands the proxy a cached file's descriptor over it, tagged with the
+ * segment's offset, so large files are served from the page cache
+ * without the copy loop.
+ */
+static socklen_t fd_addr(struct sockaddr_un* addr) 
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s_fd", 
+             SHM_ARENA);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + 
+           strlen(addr->sun_path + 1);
+}
+
+int fd_snd_ini() 
+{
+    return socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+}
+
+int fd_rcv_ini() 
+{
+    struct sockaddr_un addr;
+    socklen_t          len    = fd_addr(&addr);
+    int                fd_chl = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
 
-    mqd_t cmd_chl = mq_open(CMD_MSG_Q, O_RDWR|O_CREAT,
-                            S_IRWXU|S_IRWXG|S_IRWXO, &attr);
+    if (fd_chl < 0) 
+        return -1;
 
-    if (cmd_chl != (mqd_t)-1)
+    if (bind(fd_chl, (struct sockaddr*)&addr, len) < 0) 
     {
-        req.cmd_type = SYNC;
-        mq_send(cmd_chl, (const char*)&req, sizeof(req), 0); 
+        close(fd_chl);
+        return -1;
     }
+    return fd_chl;
+}
 
-    return cmd_chl;
+int fd_send(int fd_chl, size_t shmoff, int fd) 
+{
+    struct sockaddr_un addr;
+    struct msghdr      msg  = {0};
+    struct iovec       iov;
+    union {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    iov.iov_base       = &shmoff;
+    iov.iov_len        = sizeof(shmoff);
+    msg.msg_name       = &addr;
+    msg.msg_namelen    = fd_addr(&addr);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return (sendmsg(fd_chl, &msg, MSG_NOSIGNAL) == sizeof(shmoff)) ? 0 : -1;
 }
 
-mqd_t cmd_rcv_ini() 
+static int fd_recv_one(int fd_chl, size_t* shmoff) 
+{
+    struct msghdr msg  = {0};
+    struct iovec  iov;
+    int           fd   = -1;
+    union {
+        char           buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+
+    iov.iov_base       = shmoff;
+    iov.iov_len        = sizeof(*shmoff);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    if (recvmsg(fd_chl, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC) != 
+        sizeof(*shmoff)) 
+        return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && 
+        cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* 
+ * The descriptor is queued before the header is published, so it is
+ * either on the socket or another worker already pulled it and routes
+ * it to shm->xfd; descriptors for other segments are routed the same way.
+ */
+int fd_recv(int fd_chl, shm_t* shm) 
+{
+    time_t deadline = time(NULL) + SHM_TIMEOUT / 1000;
+    int    fd;
+
+    while (-1 == (fd = __atomic_exchange_n(&shm->xfd, -1, __ATOMIC_ACQUIRE))) 
+    {
+        size_t shmoff;
+        int    got = fd_recv_one(fd_chl, &shmoff);
+        if (got < 0) 
+        {
+            if (time(NULL) > deadline) 
+                return -1;
+            sched_yield();
+            continue;
+        }
+
+        shm_t* dst = (shm_t*)(arena_base + shmoff);
+        if (dst == shm) 
+            return got;
+        if (shmoff >= arena_size || shmoff % ARENA_MIN_BLOCK) 
+            close(got);
+        else if (-1 != (got = __atomic_exchange_n(&dst->xfd, got, 
+                                                  __ATOMIC_RELEASE)))
+            close(got);
+    }
+    return fd;
+}
+
+/* 
+ * Per simplecached instance names, the queue and the stats page: base
+ * suffixed ".idx" past the first, so a single daemon keeps plain names.
+ */
+void cmd_name(char* buf, size_t size, const char* base, unsigned int idx) 
+{
+    if (idx == 0) 
+        snprintf(buf, size, "%s", base);
+    else 
+        snprintf(buf, size, "%s.%u", base, idx);
+}
+
+static mqd_t cmd_open(unsigned int idx, int oflag) 
 {
     struct mq_attr attr;
-    req_t          req;
+    char           name[NAME_MAX];
 
     attr.mq_msgsize = sizeof(req_t);
     attr.mq_maxmsg  = 8;
     attr.mq_curmsgs = 0;
     attr.mq_flags   = 0;
 
-    mqd_t cmd_chl = -1;
-    while ((mqd_t)-1 == (cmd_chl = mq_open(CMD_MSG_Q, O_RDWR,
-                                         S_IRWXU|S_IRWXG|S_IRWXO, &attr)))
-        sleep(3);
-    mq_receive(cmd_chl, (char*)&req, sizeof(req), NULL);
+    cmd_name(name, sizeof(name), CMD_MSG_Q, idx);
+    return mq_open(name, oflag, S_IRWXU|S_IRWXG|S_IRWXO, &attr);
+}
+
+/* the rings are carved from the arena, so it has to exist by now */
+cmd_chl_t* cmd_snd_ini(unsigned int idx, unsigned int nchl) 
+{
+    req_t      req;
+    cmd_chl_t* cmd_chl = calloc(1, sizeof(cmd_chl_t));
+
+    if (nchl < 1) 
+        nchl = 1;
+    if (nchl > CMD_MAX_Q) 
+        nchl = CMD_MAX_Q;
+
+    size_t off = arena_carve(arena_order(nchl * sizeof(sq_t)));
+    if (off == ARENA_EMPTY || 
+        (mqd_t)-1 == (cmd_chl->q = cmd_open(idx, O_RDWR|O_CREAT))) 
+    {
+        free(cmd_chl);
+        return NULL;
+    }
+
+    sq_t* sq = (sq_t*)(arena_base + off);
+    for (cmd_chl->nchl = 0; cmd_chl->nchl < nchl; ++cmd_chl->nchl) 
+    {
+        sq_t* ring = &sq[cmd_chl->nchl];
+        memset(ring, 0, offsetof(sq_t, slots));
+        for (uint32_t i = 0; i < SQ_SLOTS; ++i) 
+            ring->slots[i].seq = i;
+        cmd_chl->sq[cmd_chl->nchl] = ring;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.cmd_type = SYNC;
+    req.shm_off  = off;
+    req.shm_size = arena_size;
+    req.nchl     = cmd_chl->nchl;
+    mq_send(cmd_chl->q, (const char*)&req, sizeof(req), 0); 
 
     return cmd_chl;
 }
 
-req_t* get_request(mqd_t cmd_chl) 
+cmd_chl_t* cmd_rcv_ini(unsigned int idx) 
 {
-    req_t* req = calloc(1, sizeof(req_t));
-    if (-1 != mq_receive(cmd_chl, (char*)req, sizeof(req_t), NULL))
-        return req;
+    req_t      req;
+    cmd_chl_t* cmd_chl = calloc(1, sizeof(cmd_chl_t));
 
-    free(req);
-    return NULL;
+    while ((mqd_t)-1 == (cmd_chl->q = cmd_open(idx, O_RDWR)))
+        sleep(3);
+
+    do 
+        mq_receive(cmd_chl->q, (char*)&req, sizeof(req), NULL);
+    while (req.cmd_type != SYNC);
+
+    if (arena_attach(req.shm_size) || req.nchl < 1 || 
+        req.nchl > CMD_MAX_Q || 
+        req.shm_off + req.nchl * sizeof(sq_t) > arena_size) 
+    {
+        arena_detach();
+        mq_close(cmd_chl->q);
+        free(cmd_chl);
+        return NULL;
+    }
+
+    sq_t* sq = (sq_t*)(arena_base + req.shm_off);
+    for (cmd_chl->nchl = 0; cmd_chl->nchl < req.nchl; ++cmd_chl->nchl) 
+        cmd_chl->sq[cmd_chl->nchl] = &sq[cmd_chl->nchl];
+
+    return cmd_chl;
 }
 
-void req_send(mqd_t cmd_chl, const char* path, const char* shmnm,
-              size_t shmsz) 
+int cmd_synced(cmd_chl_t* cmd_chl) 
 {
-    req_t req;
-    req.cmd_type = GET;
-    req.shm_size = shmsz;
+    struct mq_attr attr;
+    return 0 == mq_getattr(cmd_chl->q, &attr) && attr.mq_curmsgs == 0;
+}
 
-    strcpy(req.seg_name, shmnm);
-    strcpy(req.path, path);
+static uint64_t hash_mix(uint64_t a, uint64_t b) 
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    mq_send(cmd_chl, (const char*)&req, sizeof(req), 0);
+/* 
+ * wyhash style: eight bytes per multiply, folded with the length. The
+ * proxy computes it once per request and the daemon indexes by it.
+ */
+uint64_t path_hash(const char* path, size_t len) 
+{
+    uint64_t seed = 0xa0761d6478bd642fULL ^ len;
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, path += 8) 
+    {
+        memcpy(&word, path, 8);
+        seed = hash_mix(word ^ 0xe7037ed1a0b428dbULL, 
+                        seed ^ 0x8ebc6af09c88c6e3ULL);
+    }
+    word = 0;
+    memcpy(&word, path, len);
+    return hash_mix(seed ^ 0x589965cc75374cc3ULL, 
+                    word ^ 0x1d8e4e27c47d124fULL);
 }
 
-sem_t* sem_create(const char* shmnm, semTyp semType) 
+static int sq_ready(sq_t* sq, uint32_t head) 
 {
-    int  init_val;
-    char sem_name[32] = {0};
+    return __atomic_load_n(&sq->slots[head & (SQ_SLOTS - 1)].seq, 
+                           __ATOMIC_SEQ_CST) == head + 1;
+}
 
-    strcpy(sem_name, shmnm);
+/* 
+ * Copies up to max requests into batch, sleeping on the bell only when
+ * the ring is empty. sleeping is raised before the last look at the ring
+ * so a producer either sees it and rings, or we see its request.
+ */
+int get_requests(sq_t* sq, req_t** batch, int max) 
+{
+    uint32_t head = sq->head;
+    int      n    = 0;
 
-    if (semType == READER) 
+    while (1) 
     {
-        init_val = 0;
-        strcat(sem_name, "_reader");
+        for (; n < max && sq_ready(sq, head); ++n, ++head) 
+        {
+            sq_slot_t* slot = &sq->slots[head & (SQ_SLOTS - 1)];
+            memcpy(batch[n], &slot->req, sizeof(req_t));
+            __atomic_store_n(&slot->seq, head + SQ_SLOTS, __ATOMIC_RELEASE);
+        }
+        if (n) 
+            break;
+
+        int spin, limit = spin_limit();
+        for (spin = 0; spin < limit && !sq_ready(sq, head); ++spin) 
+            cpu_relax();
+        if (spin < limit) 
+            continue;
+
+        __atomic_add_fetch(&sq->sleeping, 1, __ATOMIC_SEQ_CST);
+        uint32_t bell = __atomic_load_n(&sq->bell, __ATOMIC_SEQ_CST);
+        if (!sq_ready(sq, head))
+            futex(&sq->bell, FUTEX_WAIT, bell, NULL);
+        __atomic_sub_fetch(&sq->sleeping, 1, __ATOMIC_SEQ_CST);
     }
-    else 
+
+    __atomic_store_n(&sq->head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+static int sq_submit(sq_t* sq, const char* path, size_t len, 
+                     uint64_t hash, size_t shmoff, size_t shmsz, 
+                     unsigned int xfer_mask) 
+{
+    uint32_t pos = __atomic_load_n(&sq->tail, __ATOMIC_RELAXED);
+
+    while (1) 
     {
-        init_val = 1;
-        strcat(sem_name, "_writer");
+        sq_slot_t* slot = &sq->slots[pos & (SQ_SLOTS - 1)];
+        int32_t    dif  = (int32_t)(__atomic_load_n(&slot->seq, 
+                                                    __ATOMIC_ACQUIRE) - pos);
+        if (dif < 0) 
+            return -1;
+        if (dif > 0) 
+        {
+            pos = __atomic_load_n(&sq->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&sq->tail, &pos, pos + 1, 1, 
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+
+        slot->req.cmd_type  = GET;
+        slot->req.shm_off   = shmoff;
+        slot->req.shm_size  = shmsz;
+        slot->req.xfer_mask = xfer_mask;
+        slot->req.path_hash = hash;
+        memcpy(slot->req.path, path, len + 1);
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+        break;
     }
 
-    sem_t* sem = sem_open(sem_name, O_RDWR|O_CREAT, 
-                          S_IRWXU|S_IRWXG|S_IRWXO, init_val);
-    return sem;
+    if (__atomic_load_n(&sq->sleeping, __ATOMIC_SEQ_CST)) 
+    {
+        __atomic_add_fetch(&sq->bell, 1, __ATOMIC_SEQ_CST);
+        futex(&sq->bell, FUTEX_WAKE, 1, NULL);
+    }
+    return 0;
 }
 
-sem_t* get_sem(const char* shmnm, semTyp semType) 
+/* 
+ * No syscall unless the receiver is asleep; a full ring moves on to the
+ * next shard, and only when all are full does the worker yield. path
+ * must be shorter than MAX_REQUEST_LEN and is copied exactly once.
+ * Returns -1 when every shard stayed full for timeout ms.
+ */
+int req_send(cmd_chl_t* cmd_chl, const char* path, size_t len, 
+             uint64_t hash, size_t shmoff, size_t shmsz, 
+             unsigned int xfer_mask, int timeout) 
 {
-    char sem_name[NAME_LEN + 8] = {0};
-
-    strcpy(sem_name, shmnm);
+    struct timespec start, now;
+    unsigned int    nchl = cmd_chl->nchl;
+    unsigned int    idx  = __atomic_fetch_add(&cmd_chl->next, 1, 
+                                              __ATOMIC_RELAXED) % nchl;
 
-    if (semType == READER) 
-        strcat(sem_name, "_reader");
-    else 
-        strcat(sem_name, "_writer");
-  
-    sem_t* sem = sem_open(sem_name, O_RDWR, 
-                          S_IRWXU|S_IRWXG|S_IRWXO, 0);
-    return sem;
+    for (int pass = 0; ; ++pass) 
+    {
+        for (unsigned int i = 0; i < nchl; ++i) 
+            if (0 == sq_submit(cmd_chl->sq[(idx + i) % nchl], path, len, 
+                               hash, shmoff, shmsz, xfer_mask))
+                return 0;
+
+        if (timeout != SHM_FOREVER) 
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (pass == 0) 
+                start = now;
+            if ((now.tv_sec - start.tv_sec) * 1000 + 
+                (now.tv_nsec - start.tv_nsec) / 1000000 >= timeout) 
+                return -1;
+        }
+        sched_yield();
+    }
 }
 
-void cleanup_msg()
+void cleanup_msg(unsigned int idx)
 {
-    mq_unlink(CMD_MSG_Q);
+    char name[NAME_MAX];
+
+    cmd_name(name, sizeof(name), CMD_MSG_Q, idx);
+    mq_unlink(name);
 }
@@ -2,59 +2,197 @@
 #define SHM_CHANNEL_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <mqueue.h>
-#include <semaphore.h>
 
 #define NAME_LEN (64)
 #define CMD_MSG_Q "/cmd_msg_q"
+#define CMD_MAX_Q (64)
+#define CMD_NCHL  (4)
+#define CACHE_LINE (64)
+#define SHM_TIMEOUT (20000)      /* every wait timeout is in milliseconds */
+#define SHM_FOREVER (-1)
+#define SHM_ARENA "/data_shm_arena"
+#define ARENA_MIN_BLOCK (4096)
+#define ARENA_ORDERS (40)
 
 typedef enum { FILE_NOT_FOUND, FILE_FOUND, ERROR } status_t;
+
+/* transfer modes, req_t carries the mask the proxy accepts and
+ * cache_t the one the daemon picked for the response. XFER_INLINE
+ * publishes the whole file with the header, chunk_size holds its size */
+typedef enum { XFER_CHUNK = 1, XFER_RING = 2, XFER_FD = 4, 
+               XFER_INLINE = 8 } xferTyp;
+
+/* 
+ * futex backed replacement for the _reader/_writer named semaphores.
+ * Posts bump seq; the single waiter counts what it consumed in taken.
+ */
+typedef struct shm_sync_t
+{
+  volatile uint32_t seq;
+  volatile uint32_t waiters;
+  uint32_t          taken;
+} shm_sync_t;
+
+/* 
+ * reader/writer are set up once by the proxy, cache_init leaves them be,
+ * and so the words below. The proxy bumps gen for every request it
+ * sends; the daemon raises done to it as its last touch of the segment
+ * (cache_done), and neither is reset while the segment is in use.
+ * abandoned is the proxy giving up on the request, see cache_abandon.
+ */
 typedef struct cache_t
 {
+  shm_sync_t reader;
+  shm_sync_t writer;
   status_t status; 
+  xferTyp  xfer;
   size_t   file_size;
   size_t   cache_size;
   volatile size_t chunk_size;
+  volatile uint32_t gen;
+  volatile uint32_t done;
+  volatile uint32_t abandoned;
 } cache_t;
 
+/* 
+ * single-producer/single-consumer ring laid over the cache data area.
+ * head is only written by the daemon, tail only by the proxy, each on
+ * its own cache line so the two sides never share a dirty line. The
+ * waiter counts let the other side skip FUTEX_WAKE when nobody sleeps.
+ */
+#define RING_SLOTS    (8)
+#define RING_MIN_SLOT (4096)
+
+typedef struct ring_t
+{
+  volatile uint32_t head __attribute__((aligned(CACHE_LINE)));
+  volatile uint32_t head_waiters;
+  volatile uint32_t tail __attribute__((aligned(CACHE_LINE)));
+  volatile uint32_t tail_waiters;
+  uint32_t nslots        __attribute__((aligned(CACHE_LINE)));
+  size_t   slot_size;
+} ring_t;
+
+/* a zero len slot tells the proxy the daemon gave up on the file */
+typedef struct slot_t
+{
+  size_t len;
+} __attribute__((aligned(CACHE_LINE))) slot_t;
+
+/* 
+ * Head of a segment carved out of the shared arena. seg_size is the
+ * whole block, seg_off its place in the arena; xfd is proxy-local and
+ * holds a descriptor fd_recv routed here for this segment.
+ */
 typedef struct shm_t 
 {
-  char   seg_name[NAME_LEN];
-  size_t seg_size;
+  size_t       seg_off;
+  size_t       seg_size;
+  volatile int xfd;
 } shm_t;
 
 #define MAX_REQUEST_LEN 128
-typedef enum { READER, WRITER } semTyp;
 typedef enum { SYNC, ACK, GET } cmdTyp;
 
 typedef struct req_t 
 {
-  size_t shm_size;
-  char   seg_name[NAME_LEN];
+  size_t shm_off;           /* SYNC: offset of the submission rings */
+  size_t shm_size;          /* SYNC: size of the whole arena */
+  uint64_t path_hash;       /* path_hash(path), computed by the proxy */
   char   path[MAX_REQUEST_LEN];
   cmdTyp cmd_type;
+  unsigned int xfer_mask;
+  unsigned int nchl;        /* SYNC only, number of submission rings */
 } req_t;
 
+/* 
+ * Submission ring for GET requests, laid out in the arena. Proxy workers
+ * claim slots Vyukov style (seq == pos free, seq == pos + 1 filled) and
+ * only ring the bell futex when the daemon's receiver sleeps on it.
+ */
+#define SQ_SLOTS (256)
+
+typedef struct sq_slot_t
+{
+  volatile uint32_t seq;
+  req_t             req;
+} __attribute__((aligned(CACHE_LINE))) sq_slot_t;
+
+typedef struct sq_t
+{
+  volatile uint32_t tail     __attribute__((aligned(CACHE_LINE)));
+  volatile uint32_t head     __attribute__((aligned(CACHE_LINE)));
+  volatile uint32_t bell     __attribute__((aligned(CACHE_LINE)));
+  volatile uint32_t sleeping;
+  sq_slot_t         slots[SQ_SLOTS];
+} sq_t;
+
+/* 
+ * Sharded command channel, the proxy spreads requests round-robin over
+ * nchl submission rings and the daemon drains each with its own
+ * receiver thread. The message queue only carries the SYNC handshake.
+ */
+typedef struct cmd_chl_t
+{
+  unsigned int nchl;
+  unsigned int next;
+  mqd_t        q;
+  sq_t*        sq[CMD_MAX_Q];
+} cmd_chl_t;
+
 void* shm_getdata(shm_t *);
 
 void* cache_init(shm_t*);
 void* cache_get_data(cache_t *);
 void  cache_set_data(cache_t *, void*);
+void  cache_sync_init(shm_t*);
+void  cache_abandon(shm_t*);
+void  cache_done(cache_t*, uint32_t gen);
+
+int   shm_wait(shm_sync_t *, int timeout);
+void  shm_post(shm_sync_t *);
+
+ring_t* ring_init(cache_t *, unsigned int nslots);
+ring_t* ring_get(cache_t *);
+void*   ring_produce(ring_t *, int timeout);
+void*   ring_reserve(ring_t *, uint32_t ahead, int timeout);
+void    ring_publish(ring_t *, size_t len);
+void*   ring_consume(ring_t *, size_t *len, int timeout);
+void    ring_release(ring_t *);
+
+int    arena_create(size_t size);
+int    arena_attach(size_t size);
+void   arena_detach();
+size_t arena_block(size_t segsz);
+
+shm_t* shm_alloc(size_t segsz);
+void   shm_free(shm_t*);
+shm_t* shmseg_lookup(size_t shmoff, size_t shmsz);
+
 
-shm_t* create_shm(unsigned int segnum, unsigned int segsz);
+uint64_t path_hash(const char* path, size_t len);
 
-shm_t* get_shmseg(const char* shmnm, size_t shmsz);
+int  get_requests(sq_t*, req_t** batch, int max);
+int  req_send(cmd_chl_t*, const char* path, size_t len, uint64_t hash,
+              size_t shmoff, size_t shmsz, unsigned int xfer_mask,
+              int timeout);
 
+int  fd_snd_ini();
+int  fd_rcv_ini();
+int  fd_send(int fd_chl, size_t shmoff, int fd);
+int  fd_recv(int fd_chl, shm_t* shm);
 
-req_t* get_request(mqd_t);
-void req_send(mqd_t, const char* path, const char* shmnm, size_t shmsz);
+/* base, or base.idx for every instance but the first */
+void cmd_name(char* buf, size_t size, const char* base, unsigned int idx);
 
-sem_t* sem_create(const char* shmnm, semTyp);
-sem_t* get_sem(const char* shmnm, semTyp);
+cmd_chl_t* cmd_snd_ini(unsigned int idx, unsigned int nchl);
+cmd_chl_t* cmd_rcv_ini(unsigned int idx);
 
-mqd_t cmd_snd_ini();
-mqd_t cmd_rcv_ini();
+/* Nonzero once the daemon has taken the SYNC off the queue */
+int cmd_synced(cmd_chl_t*);
 
-void cleanup_msg();
+void cleanup_msg(unsigned int idx);
 
 #endif
@@ -11,36 +11,98 @@
 #include <printf.h>
 #include <curl/curl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #include "gfserver.h"
 #include "shm_channel.h"
 #include "simplecache.h"
-#include "steque.h"
+#include "mpmcq.h"
+#include "objcache.h"
+#include "diskio.h"
+#include "fdcache.h"
+#include "stats.h"
 
 #if !defined(CACHE_FAILURE)
 #define CACHE_FAILURE (-1)
 #endif // CACHE_FAILURE
 
+static unsigned int instance;
+
 static void _sig_handler(int signo){
         if (signo == SIGTERM || signo == SIGINT){
                 // you should do IPC cleanup here
-                cleanup_msg();
+                cleanup_msg(instance);
+                stats_destroy();
                 exit(signo);
         }
 }
 
-pthread_mutex_t req_q_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  req_q_cond  = PTHREAD_COND_INITIALIZER;
-steque_t req_queue;
+#define REQ_Q_CAP (64)
+#define REQ_BATCH (16)
+#define RING_MAX_SLOTS DIO_DEPTH
 
+/* 
+ * Every worker owns a request queue. Receivers hand a request to a
+ * parked worker when there is one, waking only that worker, and
+ * otherwise spread requests over the busy workers' queues; a worker
+ * that runs dry steals from the others before it parks.
+ */
 typedef struct worker_t {
-    pthread_t thread_id;
+    pthread_t         thread_id;
+    mpmcq_t           queue;
+    volatile uint32_t idle;
+    volatile uint32_t listed;       /* has an entry on idle_workers */
+    volatile uint32_t wake;
 } worker_t;
 
+worker_t*    workers;
+int          nworkers;
+unsigned int next_worker;
+mpmcq_t      idle_workers;
+int          fd_chl = -1;
+
+/* request buffers, recycled instead of a calloc per request; a stamp
+ * per buffer keeps when its request came off the ring */
+req_t*       req_slab;
+uint64_t*    req_stamps;
+mpmcq_t      req_pool;
+
+/* ring slots for misses, see ring_adapt */
+volatile unsigned int ring_depth = RING_SLOTS;
+
+/* where a response's bytes come from, see src_read */
+typedef struct src_t {
+    int    fd;
+    obj_t* obj;
+    obj_t* fill;
+    size_t off;
+} src_t;
+
 void workercb(void *args);
+req_t* steal_req(worker_t*);
+void park(worker_t*);
+void unpark(worker_t*);
+worker_t* idle_pop();
+void recvcb(void *args);
 worker_t* workers_create(int nworkers);
-void enq_req(mqd_t);
+worker_t* receivers_create(cmd_chl_t*);
+void reqs_create(int count);
+req_t* req_get();
+void req_put(req_t*);
+void enq_req(req_t*);
 void handle_req(req_t*);
+int serve_req(req_t*, cache_t*, uint64_t);
+int abandoned(cache_t*);
+ssize_t src_read(src_t*, void*, size_t);
+void src_tee(src_t*, const void*, size_t);
+void src_done(src_t*, int);
+int send_inline(src_t*, cache_t*, size_t);
+int send_chunks(src_t*, cache_t*, size_t);
+int send_ring(src_t*, cache_t*, ring_t*, size_t);
+int send_ring_aio(src_t*, cache_t*, ring_t*, size_t);
+void ring_adapt(uint64_t proxy_wait, uint64_t disk_wait);
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -48,12 +110,16 @@ void handle_req(req_t*);
 "options:\n"                                                                  \
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
 "  -t [thread_count]   Thread count for work queue (Default: 3, Range: 1-31415)\n"      \
+"  -m [mem_budget]     Resident object cache size in MiB (Default: 0, off)\n" \
+"  -n [instance]       Which of webproxy's caches this is (Default: 0)\n"     \
 "  -h                  Show this help message\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
   {"cachedir",           required_argument,      NULL,           'c'},
   {"nthreads",           required_argument,      NULL,           't'},
+  {"memory",             required_argument,      NULL,           'm'},
+  {"instance",           required_argument,      NULL,           'n'},
   {"help",               no_argument,            NULL,           'h'},
   {"hidden",                     no_argument,                    NULL,                   'i'}, /* server side */
   {NULL,                 0,                      NULL,             0}
@@ -65,13 +131,14 @@ void Usage() {
 
 int main(int argc, char **argv) {
         int nthreads = 3;
+        size_t mem_budget = 0;
         char *cachedir = "locals.txt";
         char option_char;
 
         /* disable buffering to stdout */
         setbuf(stdout, NULL);
 
-        while ((option_char = getopt_long(argc, argv, "ic:ht:", gLongOptions, NULL)) != -1) {
+        while ((option_char = getopt_long(argc, argv, "ic:ht:m:n:", gLongOptions, NULL)) != -1) {
                 switch (option_char) {
                         default:
                                 Usage();
@@ -86,6 +153,12 @@ int main(int argc, char **argv) {
                         case 't': // thread-count
                                 nthreads = atoi(optarg);
                                 break;
+                        case 'm': // memory budget
+                                mem_budget = (size_t)atol(optarg) << 20;
+                                break;
+                        case 'n': // instance
+                                instance = atoi(optarg);
+                                break;
                         case 'i': // server side usage
                                 break;
                 }
@@ -108,93 +181,405 @@ int main(int argc, char **argv) {
 
     // Initialize cache
     simplecache_init(cachedir);
+    if (objcache_init(mem_budget)) {
+            fprintf(stderr, "Unable to allocate the object cache\n");
+            exit(CACHE_FAILURE);
+    }
 
-    mqd_t cmd_chl = cmd_rcv_ini();
-    steque_init(&req_queue);
-    worker_t* workers = workers_create(nthreads);
+    char stats_name[NAME_MAX];
+    cmd_name(stats_name, sizeof(stats_name), STATS_CACHE, instance);
+    if (stats_init(stats_name))
+            fprintf(stderr, "Unable to create %s, stats are off\n", stats_name);
 
-    while (1) 
-    {
-        enq_req(cmd_chl);
-        pthread_cond_broadcast(&req_q_cond);
+    fd_chl = fd_snd_ini();
+    cmd_chl_t* cmd_chl = cmd_rcv_ini(instance);
+    if (!cmd_chl) {
+            fprintf(stderr, "Unable to map the shared arena\n");
+            exit(CACHE_FAILURE);
     }
+    reqs_create(nthreads * (REQ_Q_CAP + 1) + cmd_chl->nchl * REQ_BATCH);
+    workers = workers_create(nthreads);
+    worker_t* receivers = receivers_create(cmd_chl);
+
+    for(int i = 0; i < cmd_chl->nchl; ++i)
+        pthread_join(receivers[i].thread_id, NULL);
 
     for(int i = 0; i < nthreads; ++i)
         pthread_join(workers[i].thread_id, NULL);
 
+    for(int i = 0; i < nthreads; ++i)
+        mpmcq_destroy(&workers[i].queue);
+    mpmcq_destroy(&idle_workers);
+    mpmcq_destroy(&req_pool);
+    free(req_slab);
+    free(req_stamps);
+    free(receivers);
     free(workers);
-    pthread_mutex_destroy(&req_q_mutex);
-    pthread_cond_destroy(&req_q_cond);
+    free(cmd_chl);
+    arena_detach();
+    fdcache_destroy();
+    objcache_destroy();
     simplecache_destroy();
+    stats_destroy();
     return 0;
 }
 
 void workercb(void *args) 
 {
-    req_t *req;
+    worker_t *self = args;
+    req_t    *req;
 
     while(1) 
     {
-        pthread_mutex_lock(&req_q_mutex);
-        while (steque_isempty(&req_queue))
-            pthread_cond_wait(&req_q_cond, &req_q_mutex);
-        req = steque_pop(&req_queue);
-        pthread_mutex_unlock(&req_q_mutex);
-
-        if (req)
-            handle_req(req);
+        if (NULL == (req = mpmcq_pop(&self->queue)) &&
+            NULL == (req = steal_req(self)))
+        {
+            park(self);
+            continue;
+        }
+        handle_req(req);
     }
 }
 
-worker_t* workers_create(int nworkers) 
+req_t* steal_req(worker_t* self) 
+{
+    int    idx = self - workers;
+    req_t* req = NULL;
+
+    for (int i = 1; i < nworkers && !req; ++i) 
+        req = mpmcq_pop(&workers[(idx + i) % nworkers].queue);
+    return req;
+}
+
+/* 
+ * Goes idle, then looks at the queues once more: a receiver either
+ * claimed us or we see its request, so none is left behind with every
+ * worker asleep. Leaving early takes the idle flag back; the entry
+ * stays listed and is dropped by whichever receiver pops it.
+ */
+void park(worker_t* self) 
 {
-    worker_t* worker = calloc(nworkers, sizeof(worker_t));
+    __atomic_store_n(&self->idle, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(&self->listed, 1, __ATOMIC_SEQ_CST))
+        mpmcq_enqueue(&idle_workers, self);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
     for (int i = 0; i < nworkers; ++i) 
+        if (!mpmcq_isempty(&workers[i].queue))
+        {
+            __atomic_store_n(&self->idle, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+
+    while (!__atomic_exchange_n(&self->wake, 0, __ATOMIC_ACQUIRE))
+        syscall(SYS_futex, &self->wake, FUTEX_WAIT_PRIVATE, 0, NULL, NULL,
+                0);
+}
+
+worker_t* workers_create(int count) 
+{
+    worker_t* worker = calloc(count, sizeof(worker_t));
+
+    nworkers = count;
+    mpmcq_init(&idle_workers, count);
+    for (int i = 0; i < count; ++i) 
+        mpmcq_init(&worker[i].queue, REQ_Q_CAP);
+
+    workers = worker;
+    for (int i = 0; i < count; ++i) 
         pthread_create(&worker[i].thread_id, NULL, (void *)&workercb,
                        &worker[i]);
     return worker;
 }
 
-void enq_req(mqd_t cmd_chl) 
+/* one receiver per submission ring, each takes requests in batches */
+void recvcb(void *args) 
 {
-    req_t* req = get_request(cmd_chl);
-    if (req) 
+    sq_t*  sq = args;
+    req_t* batch[REQ_BATCH];
+
+    for (int i = 0; i < REQ_BATCH; ++i) 
+        batch[i] = req_get();
+
+    while (1) 
     {
-        pthread_mutex_lock(&req_q_mutex);
-        steque_enqueue(&req_queue, req);
-        pthread_mutex_unlock(&req_q_mutex);
+        int      n   = get_requests(sq, batch, REQ_BATCH);
+        uint64_t now = stats_now();
+        for (int i = 0; i < n; ++i) 
+        {
+            req_stamps[batch[i] - req_slab] = now;
+            enq_req(batch[i]);
+            batch[i] = req_get();
+        }
     }
 }
 
+worker_t* receivers_create(cmd_chl_t* cmd_chl) 
+{
+    worker_t* receiver = calloc(cmd_chl->nchl, sizeof(worker_t));
+
+    for (int i = 0; i < cmd_chl->nchl; ++i) 
+        pthread_create(&receiver[i].thread_id, NULL, (void *)&recvcb,
+                       cmd_chl->sq[i]);
+    return receiver;
+}
+
+/* 
+ * Sized for every queue full plus a batch per receiver, so req_get
+ * only waits when the workers are that far behind.
+ */
+void reqs_create(int count) 
+{
+    req_slab   = calloc(count, sizeof(req_t));
+    req_stamps = calloc(count, sizeof(uint64_t));
+    mpmcq_init(&req_pool, count);
+    for (int i = 0; i < count; ++i) 
+        mpmcq_enqueue(&req_pool, &req_slab[i]);
+}
+
+req_t* req_get() 
+{
+    return mpmcq_pop_wait(&req_pool);
+}
+
+void req_put(req_t* req) 
+{
+    mpmcq_enqueue(&req_pool, req);
+}
+
+/* pops listed workers until one is still idle and claims it */
+worker_t* idle_pop() 
+{
+    worker_t* worker;
+    while (NULL != (worker = mpmcq_pop(&idle_workers))) 
+    {
+        uint32_t idle = 1;
+        __atomic_store_n(&worker->listed, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_compare_exchange_n(&worker->idle, &idle, 0, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return worker;
+    }
+    return NULL;
+}
+
+void enq_req(req_t* req) 
+{
+    worker_t* idle = idle_pop();
+    if (idle && 0 == mpmcq_enqueue(&idle->queue, req)) 
+    {
+        unpark(idle);
+        return;
+    }
+
+    /* all queues full stalls this receiver, the ring absorbs the rest */
+    while (1) 
+    {
+        unsigned int idx = __atomic_fetch_add(&next_worker, 1, 
+                                              __ATOMIC_RELAXED);
+        if (0 == mpmcq_enqueue(&workers[idx % nworkers].queue, req))
+            break;
+        sched_yield();
+    }
+
+    /* a worker that parked meanwhile comes back to steal it, see park */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (idle || NULL != (idle = idle_pop()))
+        unpark(idle);
+}
+
+void unpark(worker_t* worker) 
+{
+    __atomic_store_n(&worker->wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &worker->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 void handle_req(req_t* req)
 {
-    char  *shmnm = req->seg_name;
-    size_t shmsz = req->shm_size;
-    shm_t* shm   = get_shmseg(shmnm, shmsz);
+    uint64_t start = stats_stage(ST_QUEUED, req_stamps[req - req_slab]);
+    shm_t*   shm   = shmseg_lookup(req->shm_off, req->shm_size);
     if (!shm)
+    {
+        req_put(req);
+        stats_count(C_ERRORS, 1);
         return;
-    
-    sem_t* semr = get_sem(shm->seg_name, READER);
-    sem_t* semw = get_sem(shm->seg_name, WRITER);
-    sem_wait(semw);
-    cache_t* cache = cache_init(shm);
-
-    char* path = req->path;
-    int fd = simplecache_get(path);
+    }
+
+    cache_t* cache = shm_getdata(shm);
+    shm_wait(&cache->writer, SHM_FOREVER);
+    uint32_t gen = cache->gen;
+    cache_init(shm);
+
+    if (serve_req(req, cache, stats_stage(ST_SEG_ACQ, start)))
+        stats_count(abandoned(cache) ? C_ABANDONED : C_ERRORS, 1);
+    stats_count(C_REQUESTS, 1);
+    stats_stage(ST_SERVE, start);
+
+    /* an abandoned segment goes back to the proxy's pool with this */
+    cache_done(cache, gen);
+}
+
+/* 
+ * Returns -1 when the response was cut short, req is back in the pool.
+ * A request the proxy gave up on is dropped at the next wait.
+ */
+int serve_req(req_t* req, cache_t* cache, uint64_t t)
+{
+    if (abandoned(cache))
+    {
+        req_put(req);
+        return -1;
+    }
+
+    src_t  src  = { -1, NULL, NULL, 0 };
+    char*  path = req->path;
+    size_t file_size;
+    int    fd = fdcache_get(path, req->path_hash, &file_size);
+    stats_stage(ST_LOOKUP, t);
     if (fd == -1) 
     {
         cache->status = FILE_NOT_FOUND;
-        sem_post(semr);
-        return;
+        shm_post(&cache->reader);
+        req_put(req);
+        stats_count(C_NOT_FOUND, 1);
+        return 0;
     }
 
-    size_t file_size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
+    /* the lookup above already retired the resident copy of a changed file */
+    if (NULL != (src.obj = objcache_get(path, req->path_hash)))
+    {
+        file_size = src.obj->size;
+        stats_count(C_OBJ_HITS, 1);
+    }
+    else
+        src.fd = fd;
+
     cache->status = FILE_FOUND;
     cache->file_size = file_size;
-    sem_post(semr);
-    sem_wait(semw);
+
+    /* files that would take several chunks go out as a descriptor */
+    if (!src.obj && (req->xfer_mask & XFER_FD) && 
+        file_size > cache->cache_size &&
+        0 == fd_send(fd_chl, req->shm_off, src.fd))
+    {
+        cache->xfer = XFER_FD;
+        shm_post(&cache->reader);
+        req_put(req);
+        stats_count(C_XFER_FD, 1);
+        return 0;
+    }
+
+    if (!src.obj)
+        src.fill = objcache_fill(path, req->path_hash, file_size);
+
+    int ret;
+
+    /* whatever fits the segment goes out with the header, one post */
+    if ((req->xfer_mask & XFER_INLINE) && file_size <= cache->cache_size)
+    {
+        req_put(req);
+        stats_count(C_XFER_INLINE, 1);
+        ret = send_inline(&src, cache, file_size);
+        goto done;
+    }
+
+    ring_t* ring = NULL;
+    if (req->xfer_mask & XFER_RING)
+        ring = ring_init(cache, src.obj ? RING_SLOTS : ring_depth);
+    req_put(req);
+
+    cache->xfer = ring ? XFER_RING : XFER_CHUNK;
+    shm_post(&cache->reader);
+
+    stats_count(ring ? C_XFER_RING : C_XFER_CHUNK, 1);
+    if (ring && !src.obj)
+        ret = send_ring_aio(&src, cache, ring, file_size);
+    else if (ring)
+        ret = send_ring(&src, cache, ring, file_size);
+    else
+        ret = send_chunks(&src, cache, file_size);
+
+  done:
+    src_done(&src, ret);
+    if (ret == 0)
+        stats_count(C_BYTES, file_size);
+    return ret;
+}
+
+/* 
+ * Reads the next bytes of a response, from the resident copy on a hit
+ * or from the file on a miss, teeing them into the object being filled.
+ * The descriptor is shared by every request for the file, hence pread.
+ */
+ssize_t src_read(src_t* src, void* buffer, size_t len)
+{
+    if (src->obj)
+    {
+        ssize_t read_len = objcache_read(src->obj, src->off, buffer, len);
+        src->off += read_len;
+        return read_len;
+    }
+
+    uint64_t t        = stats_now();
+    ssize_t  read_len = pread(src->fd, buffer, len, src->off);
+    stats_stage(ST_DISK, t);
+    if (read_len > 0)
+        src_tee(src, buffer, read_len);
+    return read_len;
+}
+
+void src_tee(src_t* src, const void* buffer, size_t len)
+{
+    if (src->fill)
+        objcache_write(src->fill, src->off, buffer, len);
+    src->off += len;
+}
+
+void src_done(src_t* src, int ret)
+{
+    if (src->obj)
+        objcache_put(src->obj);
+
+    if (src->fill)
+    {
+        if (ret == 0 && src->off == src->fill->size)
+            objcache_commit(src->fill);
+        else
+            objcache_abort(src->fill);
+    }
+}
+
+int send_inline(src_t* src, cache_t* cache, size_t file_size)
+{
+    size_t transferred = 0;
+    char*  buffer      = cache_get_data(cache);
+    while (transferred < file_size)
+    {
+        ssize_t read_len = src_read(src, buffer + transferred,
+                                    file_size - transferred);
+        if (read_len <= 0)
+            break;
+        transferred += read_len;
+    }
+
+    cache->xfer       = XFER_INLINE;
+    cache->chunk_size = transferred;
+    if (transferred < file_size)
+        cache->status = ERROR;
+    shm_post(&cache->reader);
+    return (transferred == file_size) ? 0 : -1;
+}
+
+/* a stale read is fine, cache_abandon wakes whatever wait follows */
+int abandoned(cache_t* cache)
+{
+    return __atomic_load_n(&cache->abandoned, __ATOMIC_ACQUIRE);
+}
+
+int send_chunks(src_t* src, cache_t* cache, size_t file_size)
+{
+    shm_wait(&cache->writer, SHM_FOREVER);
+    if (abandoned(cache))
+        return -1;
 
     size_t transferred = 0;
     void*  buffer      = cache_get_data(cache);
@@ -204,17 +589,166 @@ void handle_req(req_t* req)
         size_t remained = (file_size - transferred);
         size_t requested = (cachesize > remained) ? remained :
                                                     cachesize;
-        ssize_t read_len = read(fd, buffer, requested);
+        ssize_t read_len = src_read(src, buffer, requested);
         if (read_len <= 0) 
         {
             cache->status = ERROR;
-            sem_post(semr);
-            return;
+            shm_post(&cache->reader);
+            return -1;
         }
         transferred += read_len;
         cache->chunk_size = read_len;
-        sem_post(semr);
-        sem_wait(semw);
+        shm_post(&cache->reader);
+
+        uint64_t t = stats_now();
+        shm_wait(&cache->writer, SHM_FOREVER);
+        stats_stage(ST_PROXY_WAIT, t);
+        if (abandoned(cache))
+            return -1;
+    }
+    return 0;
+}
+
+/* 
+ * Fills slot N+1 while the proxy is still sending slot N; no reader/
+ * writer round trip per chunk, the proxy releases the segment once it has
+ * drained file_size bytes.
+ */
+int send_ring(src_t* src, cache_t* cache, ring_t* ring, size_t file_size)
+{
+    size_t transferred = 0;
+    while (transferred < file_size)
+    {
+        if (abandoned(cache))
+            return -1;
+
+        uint64_t t    = stats_now();
+        void*    slot = ring_produce(ring, SHM_TIMEOUT);
+        stats_stage(ST_PROXY_WAIT, t);
+        if (!slot)
+            return -1;
+
+        size_t remained  = (file_size - transferred);
+        size_t requested = (ring->slot_size > remained) ? remained :
+                                                          ring->slot_size;
+        ssize_t read_len = src_read(src, slot, requested);
+        if (read_len <= 0) 
+        {
+            ring_publish(ring, 0);
+            return -1;
+        }
+        transferred += read_len;
+        ring_publish(ring, read_len);
+    }
+    return 0;
+}
+
+/* 
+ * Misses keep a read in flight for every free ring slot, each going
+ * straight into its slot, so the disk works on chunk N+1.. while the
+ * proxy still sends chunk N. Completions are published in file order.
+ */
+int send_ring_aio(src_t* src, cache_t* cache, ring_t* ring, 
+                  size_t file_size)
+{
+    void*    slots[RING_MAX_SLOTS];
+    size_t   want[RING_MAX_SLOTS];
+    ssize_t  got[RING_MAX_SLOTS];
+    int      ready[RING_MAX_SLOTS];
+    uint64_t proxy_wait = 0;
+    uint64_t disk_wait  = 0;
+    uint64_t tag;
+    ssize_t  res;
+    uint32_t mask      = ring->nslots - 1;
+    uint32_t reserved  = 0;
+    uint32_t pending   = 0;
+    size_t   queued    = 0;
+    size_t   published = 0;
+    int      ret       = 0;
+
+    while (published < file_size)
+    {
+        while (reserved < ring->nslots && queued < file_size)
+        {
+            if (!reserved && abandoned(cache))
+                break;
+
+            uint64_t t    = stats_now();
+            void*    slot = ring_reserve(ring, reserved, 
+                                         reserved ? 0 : SHM_TIMEOUT);
+            if (!reserved)
+                proxy_wait += stats_stage(ST_PROXY_WAIT, t) - t;
+            if (!slot)
+                break;
+
+            uint32_t idx = (ring->head + reserved) & mask;
+            size_t   len = file_size - queued;
+            if (len > ring->slot_size)
+                len = ring->slot_size;
+            if (dio_read(src->fd, slot, len, queued, idx))
+                break;
+
+            slots[idx] = slot;
+            want[idx]  = len;
+            ready[idx] = 0;
+            queued    += len;
+            reserved++;
+            pending++;
+        }
+
+        uint64_t t = stats_now();
+        if (!pending || dio_wait(&tag, &res))
+        {
+            ret = -1;
+            break;
+        }
+        disk_wait += stats_stage(ST_DISK, t) - t;
+        pending--;
+        got[tag]   = res;
+        ready[tag] = 1;
+
+        for (; reserved; --reserved)
+        {
+            uint32_t idx = ring->head & mask;
+            if (!ready[idx])
+                break;
+            if (got[idx] != (ssize_t)want[idx])
+            {
+                ret = -1;
+                goto done;
+            }
+            src_tee(src, slots[idx], want[idx]);
+            ring_publish(ring, want[idx]);
+            published += want[idx];
+        }
     }
-    free(req);
+
+  done:
+    /* the reads still out target the segment, let them land first */
+    for (; pending; --pending)
+        if (dio_wait(&tag, &res))
+            break;
+    /* the terminator needs a slot of its own, a ring the proxy never
+     * drained has none and is left to its reply timeout */
+    if (ret && (reserved || ring_reserve(ring, 0, 0)))
+        ring_publish(ring, 0);
+    else if (!ret)
+        ring_adapt(proxy_wait, disk_wait);
+    return ret;
+}
+
+/* 
+ * Misses that mostly waited on the disk get more, smaller slots and so
+ * more reads in flight; misses that mostly waited on the proxy get
+ * fewer, larger ones and so fewer handoffs. Racy on purpose, the next
+ * miss corrects a lost update.
+ */
+void ring_adapt(uint64_t proxy_wait, uint64_t disk_wait)
+{
+    unsigned int depth = ring_depth;
+
+    if (disk_wait > 2 * proxy_wait && depth < RING_MAX_SLOTS)
+        ring_depth = depth * 2;
+    else if (proxy_wait > 2 * disk_wait && depth > 2)
+        ring_depth = depth / 2;
 }
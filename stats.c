@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+__thread stats_thread_t* stats_self;
+
+static stats_page_t*  page;
+static stats_thread_t sink;
+static char           page_name[64];
+
+/* ticks per second of stats_now, against CLOCK_MONOTONIC over 10ms */
+static uint64_t tick_rate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec t0, t1, nap = { 0, 10 * 1000 * 1000 };
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t start = stats_now();
+    nanosleep(&nap, NULL);
+    uint64_t ticks = stats_now() - start;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+                  t1.tv_nsec - t0.tv_nsec;
+    return ns ? (uint64_t)((double)ticks * 1e9 / ns) : 1000000000;
+#else
+    return 1000000000;
+#endif
+}
+
+int stats_init(const char* name)
+{
+    int fd = shm_open(name, O_CREAT|O_RDWR|O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, sizeof(stats_page_t)))
+    {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    page = mmap(NULL, sizeof(stats_page_t), PROT_READ|PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        page = NULL;
+        shm_unlink(name);
+        return -1;
+    }
+
+    snprintf(page_name, sizeof(page_name), "%s", name);
+    page->pid     = getpid();
+    page->tick_hz = tick_rate();
+    page->version = STATS_VERSION;
+    __atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* threads past STATS_MAX_THREADS share the sink, it is never exported */
+stats_thread_t* stats_claim()
+{
+    stats_self = &sink;
+    if (page)
+    {
+        uint32_t idx = __atomic_fetch_add(&page->nthreads, 1,
+                                          __ATOMIC_RELAXED);
+        if (idx < STATS_MAX_THREADS)
+            stats_self = &page->threads[idx];
+    }
+    return stats_self;
+}
+
+/* the mapping stays, other threads may still be recording into it */
+void stats_destroy()
+{
+    if (page)
+        shm_unlink(page_name);
+}
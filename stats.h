@@ -0,0 +1,153 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_MAGIC       (0x73746174)
+#define STATS_VERSION     (3)
+#define STATS_MAX_THREADS (256)
+#define STATS_RING        (256)
+#define STATS_BUCKETS     (48)
+#define STATS_PROXY       "/webproxy_stats"
+#define STATS_CACHE       "/simplecached_stats"
+
+/*
+ * Hot path instrumentation shared by webproxy and simplecached. Every
+ * thread owns a slot of a shared memory page holding its counters, the
+ * count/sum/max and a log2 histogram of each stage, and a ring of its
+ * most recent stage events. Only the owning thread writes a slot, so
+ * an event is a tick read and a handful of plain stores; tools/statdump
+ * maps the page read-only and may see a torn in-flight event.
+ */
+typedef enum
+{
+  /* webproxy, handle_with_cache */
+  ST_SEG_WAIT,                  /* shm_deq, waiting for a free segment */
+  ST_SUBMIT,                    /* req_send, a full ring backs up here */
+  ST_REPLY,                     /* request out until the header is in */
+  ST_BODY,                      /* header in until the last byte is sent */
+  ST_REQUEST,                   /* the whole of handle_with_cache */
+  /* simplecached, handle_req */
+  ST_QUEUED,                    /* off the ring until a worker has it */
+  ST_SEG_ACQ,                   /* waiting for the proxy to hand over */
+  ST_LOOKUP,                    /* fdcache_get, simplecache_get on a miss */
+  ST_DISK,                      /* pread or io_uring completion */
+  ST_PROXY_WAIT,                /* waiting for the proxy to drain */
+  ST_SERVE,                     /* the whole of handle_req */
+  ST_COUNT
+} stage_t;
+
+typedef enum
+{
+  C_REQUESTS,
+  C_NOT_FOUND,
+  C_ERRORS,
+  C_BYTES,
+  C_XFER_INLINE,
+  C_XFER_FD,
+  C_XFER_RING,
+  C_XFER_CHUNK,
+  C_OBJ_HITS,
+  C_SEG_CARVED,                 /* shm_deq carved a new segment */
+  C_SEG_BORROWED,               /* shm_deq took one of a larger class */
+  C_SEG_BLOCKED,                /* shm_deq had to wait */
+  C_SEG_RECLASSED,              /* seg_tune moved a class */
+  C_SEG_FREED,                  /* seg_tune gave a segment back */
+  C_SEG_TIMEOUT,                /* shm_deq ran into its deadline */
+  C_ABANDONED,                  /* requests given up on past the header */
+  C_FALLBACK,                   /* served by the fallback handler */
+  C_SHED,                       /* failed fast with GF_ERROR */
+  C_COUNT
+} counter_t;
+
+typedef struct stats_ev_t
+{
+  uint64_t start;
+  uint32_t ticks;               /* saturates at UINT32_MAX */
+  uint32_t stage;
+} stats_ev_t;
+
+typedef struct stats_stage_t
+{
+  uint64_t count;
+  uint64_t ticks;
+  uint64_t max;
+  uint64_t hist[STATS_BUCKETS]; /* bucket b counts durations < 2^b ticks */
+} stats_stage_t;
+
+typedef struct stats_thread_t
+{
+  uint64_t          counters[C_COUNT];
+  stats_stage_t     stages[ST_COUNT];
+  volatile uint64_t ev_head;
+  stats_ev_t        ev[STATS_RING];
+} __attribute__((aligned(64))) stats_thread_t;
+
+typedef struct stats_page_t
+{
+  uint32_t          magic;
+  uint32_t          version;
+  pid_t             pid;
+  volatile uint32_t nthreads;
+  uint64_t          tick_hz;
+  stats_thread_t    threads[STATS_MAX_THREADS];
+} stats_page_t;
+
+extern __thread stats_thread_t* stats_self;
+
+/* Creates the named page, until then every event goes to a sink slot */
+int stats_init(const char* name);
+
+/* Claims the calling thread's slot, the sink once the page is full */
+stats_thread_t* stats_claim();
+
+void stats_destroy();
+
+/* rdtsc where there is one; statdump converts with the page's tick_hz */
+static inline uint64_t stats_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline stats_thread_t* stats_slot()
+{
+    return stats_self ? stats_self : stats_claim();
+}
+
+static inline void stats_count(counter_t counter, uint64_t n)
+{
+    stats_slot()->counters[counter] += n;
+}
+
+/* Records stage as running from start until now, returns now */
+static inline uint64_t stats_stage(stage_t stage, uint64_t start)
+{
+    stats_thread_t* self  = stats_slot();
+    stats_stage_t*  st    = &self->stages[stage];
+    uint64_t        now   = stats_now();
+    uint64_t        ticks = now - start;
+    int             b     = ticks ? 64 - __builtin_clzll(ticks) : 0;
+
+    st->count++;
+    st->ticks += ticks;
+    if (ticks > st->max)
+        st->max = ticks;
+    st->hist[b < STATS_BUCKETS ? b : STATS_BUCKETS - 1]++;
+
+    stats_ev_t* ev = &self->ev[self->ev_head % STATS_RING];
+    ev->start = start;
+    ev->ticks = ticks > UINT32_MAX ? UINT32_MAX : (uint32_t)ticks;
+    ev->stage = stage;
+    __atomic_store_n(&self->ev_head, self->ev_head + 1, __ATOMIC_RELEASE);
+    return now;
+}
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * statdump - prints the stats page of a running webproxy or simplecached
+ * without stopping it, see stats.h.
+ *
+ *   gcc -O2 -I. -o tools/statdump tools/statdump.c -lrt
+ *   tools/statdump [-c] [-n instance] [-i secs] [-e events] [page]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  statdump [options] [page]\n"                                               \
+"options:\n"                                                                  \
+"  -c                  Read simplecached's page (Default: " STATS_PROXY ")\n" \
+"  -n [instance]       Read that simplecached -n instance's page\n"           \
+"  -i [interval]       Print the deltas every interval seconds\n"             \
+"  -e [events]         Dump each thread's most recent events\n"               \
+"  -h                  Show this help message\n"
+
+static const char* stage_names[ST_COUNT] = {
+    "seg_wait", "submit", "reply", "body", "request",
+    "queued", "seg_acq", "lookup", "disk", "proxy_wait", "serve"
+};
+
+static const char* counter_names[C_COUNT] = {
+    "requests", "not_found", "errors", "bytes", "xfer_inline", "xfer_fd",
+    "xfer_ring", "xfer_chunk", "obj_hits", "seg_carved", "seg_borrowed",
+    "seg_blocked", "seg_reclassed", "seg_freed", "seg_timeout",
+    "abandoned", "fallback", "shed"
+};
+
+/* every thread folded into one */
+typedef struct total_t
+{
+    uint64_t      counters[C_COUNT];
+    stats_stage_t stages[ST_COUNT];
+} total_t;
+
+stats_page_t* page_map(const char* name);
+void page_sum(stats_page_t* page, total_t* total);
+void page_print(stats_page_t* page, total_t* now, total_t* prev);
+void events_print(stats_page_t* page, int nevents);
+double quantile_us(stats_page_t* page, stats_stage_t* st, double q);
+
+int main(int argc, char **argv)
+{
+    const char* name     = STATS_PROXY;
+    char        instance[64];
+    int         interval = 0;
+    int         nevents  = 0;
+    int         option_char;
+
+    while ((option_char = getopt(argc, argv, "cn:i:e:h")) != -1)
+    {
+        switch (option_char)
+        {
+            default:
+                fprintf(stderr, "%s", USAGE);
+                exit(1);
+            case 'h':
+                fprintf(stdout, "%s", USAGE);
+                exit(0);
+            case 'c': name     = STATS_CACHE;  break;
+            case 'n':
+                /* simplecached suffixes every instance but the first */
+                snprintf(instance, sizeof(instance), "%s.%s", STATS_CACHE,
+                         optarg);
+                name = atoi(optarg) ? instance : STATS_CACHE;
+                break;
+            case 'i': interval = atoi(optarg); break;
+            case 'e': nevents  = atoi(optarg); break;
+        }
+    }
+    if (optind < argc)
+        name = argv[optind];
+
+    stats_page_t* page = page_map(name);
+    if (!page)
+        exit(1);
+
+    total_t* now  = calloc(1, sizeof(total_t));
+    total_t* prev = calloc(1, sizeof(total_t));
+
+    page_sum(page, now);
+    page_print(page, now, NULL);
+    if (nevents > 0)
+        events_print(page, nevents);
+
+    while (interval > 0)
+    {
+        total_t* swap = prev;
+        prev = now;
+        now  = swap;
+
+        sleep(interval);
+        page_sum(page, now);
+        printf("\n");
+        page_print(page, now, prev);
+    }
+    return 0;
+}
+
+stats_page_t* page_map(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror(name);
+        return NULL;
+    }
+
+    stats_page_t* page = mmap(NULL, sizeof(stats_page_t), PROT_READ,
+                              MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        perror(name);
+        return NULL;
+    }
+    if (page->magic != STATS_MAGIC || page->version != STATS_VERSION)
+    {
+        fprintf(stderr, "%s: not a version %d stats page\n", name,
+                STATS_VERSION);
+        return NULL;
+    }
+    return page;
+}
+
+static uint32_t page_threads(stats_page_t* page)
+{
+    uint32_t n = page->nthreads;
+    return (n < STATS_MAX_THREADS) ? n : STATS_MAX_THREADS;
+}
+
+void page_sum(stats_page_t* page, total_t* total)
+{
+    memset(total, 0, sizeof(total_t));
+    for (uint32_t i = 0; i < page_threads(page); ++i)
+    {
+        stats_thread_t* th = &page->threads[i];
+
+        for (int c = 0; c < C_COUNT; ++c)
+            total->counters[c] += th->counters[c];
+
+        for (int s = 0; s < ST_COUNT; ++s)
+        {
+            stats_stage_t* src = &th->stages[s];
+            stats_stage_t* dst = &total->stages[s];
+
+            dst->count += src->count;
+            dst->ticks += src->ticks;
+            if (src->max > dst->max)
+                dst->max = src->max;
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+                dst->hist[b] += src->hist[b];
+        }
+    }
+}
+
+/* upper bound of the log2 bucket holding the q-th duration, or max */
+double quantile_us(stats_page_t* page, stats_stage_t* st, double q)
+{
+    uint64_t want  = (uint64_t)(q * st->count);
+    uint64_t seen  = 0;
+    uint64_t ticks = st->max;
+
+    for (int b = 0; b < STATS_BUCKETS; ++b)
+    {
+        seen += st->hist[b];
+        if (seen > want)
+        {
+            if ((1ULL << b) < ticks)
+                ticks = 1ULL << b;
+            break;
+        }
+    }
+    return (double)ticks * 1e6 / page->tick_hz;
+}
+
+/* with prev, counts and histograms are the difference to it, max is
+ * always the lifetime one */
+void page_print(stats_page_t* page, total_t* now, total_t* prev)
+{
+    printf("pid %d, %u threads, %.0f MHz ticks\n", (int)page->pid,
+           page_threads(page), page->tick_hz / 1e6);
+
+    for (int c = 0; c < C_COUNT; ++c)
+        printf("  %-14s %llu\n", counter_names[c], (unsigned long long)
+               (now->counters[c] - (prev ? prev->counters[c] : 0)));
+
+    printf("  %-14s %10s %10s %10s %10s %10s\n", "stage", "count",
+           "mean_us", "p50_us", "p99_us", "max_us");
+    for (int s = 0; s < ST_COUNT; ++s)
+    {
+        stats_stage_t st = now->stages[s];
+        if (prev)
+        {
+            st.count -= prev->stages[s].count;
+            st.ticks -= prev->stages[s].ticks;
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+                st.hist[b] -= prev->stages[s].hist[b];
+        }
+        if (st.count == 0)
+            continue;
+
+        printf("  %-14s %10llu %10.2f %10.2f %10.2f %10.2f\n", stage_names[s],
+               (unsigned long long)st.count,
+               (double)st.ticks / st.count * 1e6 / page->tick_hz,
+               quantile_us(page, &st, 0.5), quantile_us(page, &st, 0.99),
+               (double)st.max * 1e6 / page->tick_hz);
+    }
+}
+
+/* newest last; an entry being overwritten right now may come out torn */
+void events_print(stats_page_t* page, int nevents)
+{
+    if (nevents > STATS_RING)
+        nevents = STATS_RING;
+
+    for (uint32_t i = 0; i < page_threads(page); ++i)
+    {
+        stats_thread_t* th   = &page->threads[i];
+        uint64_t        head = __atomic_load_n(&th->ev_head,
+                                               __ATOMIC_ACQUIRE);
+        uint64_t        from = (head > (uint64_t)nevents) ? head - nevents : 0;
+        if (from == head)
+            continue;
+
+        uint64_t base = th->ev[from % STATS_RING].start;
+        printf("thread %u\n", i);
+        for (uint64_t pos = from; pos < head; ++pos)
+        {
+            stats_ev_t ev = th->ev[pos % STATS_RING];
+            const char* stage = (ev.stage < ST_COUNT) ? stage_names[ev.stage] :
+                                                        "?";
+            printf("  +%12.2f us %-12s %10.2f us\n",
+                   (double)(int64_t)(ev.start - base) * 1e6 / page->tick_hz,
+                   stage, (double)ev.ticks * 1e6 / page->tick_hz);
+        }
+    }
+}
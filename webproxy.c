@@ -10,6 +10,11 @@
 #include <curl/curl.h>
 
 #include "gfserver.h"
+#include "proxy-student.h"
+#include "curl_engine.h"
+#include "shm_channel.h"
+#include "hotcache.h"
+#include "stats.h"
 
 #define USAGE                                                                         \
 "usage:\n"                                                                            \
@@ -19,6 +24,17 @@
 "  -s [server]         The server to connect to (Default: Udacity S3 instance)\n"     \
 "  -x                  Experimental Option (Bonnie Only)\n"                           \
 "  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1024)\n"              \
+"  -e [event_loops]    Fetch on curl_multi event loops (Default: 0, off)\n"           \
+"  -k                  Serve from simplecached instead of curl\n"                     \
+"  -q [queues]         Command queues to simplecached (Default: 4)\n"                 \
+"  -c [caches]         simplecached instances, started with -n 0.. (Default: 1)\n"    \
+"  -n [segment_count]  Segments per size class (Default: 8)\n"                        \
+"  -m [hot_cache_mib]  In-process hot object cache size (Default: 0, off)\n"          \
+"  -l [hot_ttl_secs]   Seconds a hot object is served, 0 off (Default: 1)\n"          \
+"  -z [segment_size]   Size[:count] classes, e.g. 4096:16,65536:8 (Default: 4096)\n" \
+"  -w [seg_wait_ms]    Wait for a free segment, -1 forever (Default: 1000)\n"         \
+"  -d [reply_wait_ms]  Wait for each simplecached reply (Default: 20000)\n"           \
+"  -f                  Fetch with curl when the cache can't take a request\n"         \
 "  -h                  Show this help message\n"
 
 
@@ -27,6 +43,17 @@ static struct option gLongOptions[] = {
   {"port",          required_argument,      NULL,           'p'},
   {"server",        required_argument,      NULL,           's'},
   {"thread-count",  required_argument,      NULL,           't'},
+  {"event-loops",   required_argument,      NULL,           'e'},
+  {"cache",         no_argument,            NULL,           'k'},
+  {"queues",        required_argument,      NULL,           'q'},
+  {"caches",        required_argument,      NULL,           'c'},
+  {"segment-count", required_argument,      NULL,           'n'},
+  {"segment-size",  required_argument,      NULL,           'z'},
+  {"hot-cache",     required_argument,      NULL,           'm'},
+  {"hot-ttl",       required_argument,      NULL,           'l'},
+  {"seg-wait",      required_argument,      NULL,           'w'},
+  {"reply-wait",    required_argument,      NULL,           'd'},
+  {"fallback",      no_argument,            NULL,           'f'},
   {"help",          no_argument,            NULL,           'h'},
   {NULL,            0,                      NULL,            0}
 };
@@ -36,10 +63,14 @@ extern ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg);
 extern ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg);
 
 static gfserver_t gfs;
+static int use_cache;
 
 static void _sig_handler(int signo){
   if (signo == SIGTERM || signo == SIGINT){
     gfserver_stop(&gfs);
+    if (use_cache)
+      cleanup();
+    stats_destroy();
     exit(signo);
   }
 }
@@ -49,8 +80,22 @@ int main(int argc, char **argv) {
   int option_char = 0;
   unsigned short port = 51418;
   unsigned short nworkerthreads = 1;
+  int nloops = 0;
+  unsigned int nchl = CMD_NCHL;
+  unsigned int ncaches = 1;
+  unsigned int nsegments = 8;
+  const char *segsize = "4096";
+  cmd_chl_t **cmd_chl = NULL;
+  int seg_wait = 1000;
+  int reply_wait = SHM_TIMEOUT;
+  int fallback = 0;
+  cache_worker_t *cache_workers;
+  size_t hot_budget = 0;
+  unsigned int hot_ttl = HOT_TTL;
+  hot_worker_t *hot;
   const char *server = "s3.amazonaws.com/content.udacity-data.com";
   CURLcode cg_init;
+  curl_worker_t *workers;
 
   // disable buffering on stdout so it prints immediately 
   setbuf(stdout, NULL);
@@ -66,7 +111,7 @@ int main(int argc, char **argv) {
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:hxs:t:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "p:hxs:t:e:kq:c:n:z:m:l:w:d:f", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       default:
         fprintf(stderr, "%s", USAGE);
@@ -86,6 +131,39 @@ int main(int argc, char **argv) {
       case 't': // thread-count
         nworkerthreads = atoi(optarg);
         break;
+      case 'e': // event-loops
+        nloops = atoi(optarg);
+        break;
+      case 'k': // cache
+        use_cache = 1;
+        break;
+      case 'q': // queues
+        nchl = atoi(optarg);
+        break;
+      case 'c': // caches
+        ncaches = atoi(optarg);
+        break;
+      case 'n': // segment-count
+        nsegments = atoi(optarg);
+        break;
+      case 'z': // segment-size
+        segsize = optarg;
+        break;
+      case 'm': // hot-cache
+        hot_budget = (size_t)atol(optarg) << 20;
+        break;
+      case 'l': // hot-ttl
+        hot_ttl = atoi(optarg);
+        break;
+      case 'w': // seg-wait
+        seg_wait = atoi(optarg);
+        break;
+      case 'd': // reply-wait
+        reply_wait = atoi(optarg);
+        break;
+      case 'f': // fallback
+        fallback = 1;
+        break;
     }
   }
 
@@ -105,6 +183,10 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  if (stats_init(STATS_PROXY)) {
+    fprintf(stderr, "Can't create %s, stats are off.\n", STATS_PROXY);
+  }
+
   // This is where you initialize your shared memory 
   cg_init = curl_global_init(CURL_GLOBAL_ALL);
   if (cg_init != 0)
@@ -113,15 +195,87 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  if ((nloops < 0) || (engine_init(nloops) < 0)) {
+    fprintf(stderr, "Curl event loop initialization failure.\n");
+    exit(__LINE__);
+  }
+
+  workers = curl_workers_create(nworkerthreads, server);
+  if (NULL == workers) {
+    fprintf(stderr, "Curl handle initialization failure.\n");
+    exit(__LINE__);
+  }
+
+  if (use_cache) {
+    if ((nsegments < 1) || (shm_init_classes(segsize, nsegments) < 0)) {
+      fprintf(stderr, "Invalid segment size classes\n");
+      exit(__LINE__);
+    }
+    if ((ncaches < 1) || (ncaches > 1024) || cache_shards(ncaches)) {
+      fprintf(stderr, "Invalid number of caches\n");
+      cleanup();
+      exit(__LINE__);
+    }
+    cmd_chl = calloc(ncaches, sizeof(cmd_chl_t *));
+    for(i = 0; i < ncaches; i++) {
+      if ((NULL == cmd_chl) || (NULL == (cmd_chl[i] = cmd_snd_ini(i, nchl)))) {
+        fprintf(stderr, "Command queue initialization failure.\n");
+        cleanup();
+        exit(__LINE__);
+      }
+    }
+    if (seg_wait < -1) {
+      fprintf(stderr, "Invalid segment wait\n");
+      cleanup();
+      exit(__LINE__);
+    }
+    if (reply_wait < 1) {
+      fprintf(stderr, "Invalid reply wait\n");
+      cleanup();
+      exit(__LINE__);
+    }
+    cache_timeouts(seg_wait, reply_wait);
+  }
+
+  // without -f a request the cache can't take in time fails fast
+  cache_workers = calloc(nworkerthreads, sizeof(cache_worker_t));
+  if (NULL == cache_workers) {
+    fprintf(stderr, "Worker initialization failure.\n");
+    exit(__LINE__);
+  }
+  for(i = 0; i < nworkerthreads; i++) {
+    cache_workers[i].chl          = cmd_chl;
+    cache_workers[i].fallback     = fallback ? handle_with_curl : NULL;
+    cache_workers[i].fallback_arg = &workers[i];
+  }
+
+  hot = calloc(nworkerthreads, sizeof(hot_worker_t));
+  if ((NULL == hot) || hotcache_init(hot_budget, hot_ttl)) {
+    fprintf(stderr, "Hot object cache initialization failure.\n");
+    exit(__LINE__);
+  }
+
   // This is where you initialize the server struct
   gfserver_init(&gfs, nworkerthreads);
 
   // This is where you set the options for the server 
   gfserver_setopt(&gfs, GFS_PORT, port);
   gfserver_setopt(&gfs, GFS_MAXNPENDING, 12);
-  gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_curl);
+  // the hot cache sits in front of whichever handler serves misses
   for(i = 0; i < nworkerthreads; i++) {
-    gfserver_setopt(&gfs, GFS_WORKER_ARG, i, server);
+    hot[i].handler = use_cache ? handle_with_cache : handle_with_curl;
+    hot[i].arg     = use_cache ? (void *)&cache_workers[i] : (void *)&workers[i];
+  }
+  if (hot_budget) {
+    gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_hot);
+    for(i = 0; i < nworkerthreads; i++) {
+      gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &hot[i]);
+    }
+  } else {
+    gfserver_setopt(&gfs, GFS_WORKER_FUNC, hot[0].handler);
+    for(i = 0; i < nworkerthreads; i++) {
+      gfserver_setopt(&gfs, GFS_WORKER_ARG, i, hot[i].arg);
+    }
   }
   
   // This is where you invoke the framework to run the server 